@@ -0,0 +1,36 @@
+// times morth_eval of one short line against a warm VM
+//   cc -O2 -pthread -DMORTH_LIBRARY -c morth.c -o morth.o
+//   cc -O2 -pthread -I. bench/eval.c morth.o -o eval -lm
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "morth.h"
+
+#define RUNS 1000000
+
+static double now_s(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(void) {
+  Morth *vm = morth_new();
+  const char *def = ": sq dup * ;";
+  const char *line = "3 sq 4 sq +";
+  morth_eval(vm, def, strlen(def));
+  double t = now_s();
+  int64_t sum = 0;
+  for (int i = 0; i < RUNS; i++) {
+    int64_t x;
+    if (morth_eval(vm, line, strlen(line)) != 0 || morth_pop(vm, &x) != 0) {
+      fprintf(stderr, "eval failed\n");
+      return 1;
+    }
+    sum += x;
+  }
+  t = now_s() - t;
+  printf("%lld in %.3fs, %.3fus per eval\n", (long long)sum, t, t * 1e6 / RUNS);
+  return 0;
+}
@@ -23,18 +23,33 @@ SOFTWARE.
 */
 
 #include <ctype.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <tgmath.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "morth.h"
 
 #ifndef WORD_N
 #define WORD_N 0xffff
 #endif
 
-#ifndef DEF_N
-#define DEF_N 256
+#ifndef CODE_N
+#define CODE_N 0xfffff // cells of compiled code, shared by all definitions
 #endif
 
 #ifndef MEMSIZE
@@ -45,7 +60,7 @@ SOFTWARE.
 #define NAMELEN 16
 #endif
 
-#ifndef STACHSIZE
+#ifndef STACKSIZE
 #define STACKSIZE 1024
 #endif
 
@@ -53,46 +68,222 @@ SOFTWARE.
 #define BUFSIZE 1024
 #endif
 
-struct Word;
-typedef int cell;
-typedef long int dcell;
-typedef cell (*func)(struct Word *, struct Word *);
-void add_non_primitive(char name[], cell *def, cell def_len);
-int ip_d = 0;
+#ifndef BLOCK_N
+#define BLOCK_N 64 // samples per audio block
+#endif
+
+#ifndef RING_N
+#define RING_N 64 // blocks in the output ring, must be a power of two
+#endif
+
+#ifndef RATE
+#define RATE 48000 // sample rate that render deadlines are measured against
+#endif
+
+#ifndef HIST_SUB
+#define HIST_SUB 4 // log2 of the buckets per power of two in a histogram
+#endif
+
+#ifndef VOICE_N
+#define VOICE_N 256
+#endif
+
+#ifndef THREAD_N
+#define THREAD_N 8 // render threads, including the interpreter
+#endif
+
+#ifndef PAR_CHUNK
+#define PAR_CHUNK 4096 // cells a pmap thread takes at once, whole cache lines
+#endif
+
+#ifndef TASK_N
+#define TASK_N 16384
+#endif
+
+#ifndef TASK_STACK
+#define TASK_STACK 32 // cells in a task's data and return stacks
+#endif
+
+#ifndef MEMO_SETS
+#define MEMO_SETS 1024 // sets in a thread's memo cache, a power of two
+#endif
+#define MEMO_WAYS 4
+#define MEMO_IN 4  // most cells a pure word can take
+#define MEMO_OUT 2 // and leave
+
+#ifndef FUEL_SLICE
+#define FUEL_SLICE 1024 // checks a thread runs between looks at the budget
+#endif
+
+#ifndef LOCAL_N
+#define LOCAL_N 16 // most locals in one definition
+#endif
+
+#ifndef LINE_CACHE_N
+#define LINE_CACHE_N 64 // compiled top-level lines, must be a power of two
+#endif
+
+#ifndef LINE_LEN
+#define LINE_LEN 256 // longest line the cache keeps
+#endif
+// code cells for one cached line: at most two per token, and an exit
+#define LINE_CODE_N (LINE_LEN + 2)
+
+#ifndef WORDLIST_N
+#define WORDLIST_N 16
+#endif
+
+#ifndef BUCKET_N
+#define BUCKET_N 256 // hash buckets per wordlist, must be a power of two
+#endif
+
+#ifndef ORDER_N
+#define ORDER_N 8 // wordlists in the search order
+#endif
+
+#ifndef OUT_N
+#define OUT_N 65536 // bytes of output a thread buffers
+#endif
+
+#ifndef MAP_N
+#define MAP_N 16 // files mapped at once
+#endif
+
+#ifndef MAP_CELLS
+#define MAP_CELLS ((cell)1 << 30) // membank addresses above MEMSIZE for them
+#endif
+
+#ifndef HOST_N
+#define HOST_N 256 // primitives a host program can register
+#endif
+
+struct Xt;
+#ifndef CELL_BITS
+#define CELL_BITS 32
+#endif
+
+#if CELL_BITS == 64
+typedef int64_t cell;
+typedef uint64_t ucell;
+typedef __int128 dcell;
+typedef unsigned __int128 udcell;
+typedef double fcell; // same width as a cell so it fits in one membank slot
+#define CELL_FMT "%" PRId64
+#else
+typedef int32_t cell;
+typedef uint32_t ucell;
+typedef int64_t dcell;
+typedef uint64_t udcell;
+typedef float fcell; // same width as a cell so it fits in one membank slot
+#define CELL_FMT "%" PRId32
+#endif
+#define CELL_MIN ((cell)((ucell)1 << (CELL_BITS - 1)))
+#define DCELL_MIN ((dcell)((udcell)1 << (2 * CELL_BITS - 1)))
+typedef fcell __attribute__((may_alias)) fcell_alias;
+typedef void (*func)(struct Xt *);
+static _Thread_local cell ip_d = 0; // code cell being executed
+
+// throw codes, numbered as in ANS Forth
+enum {
+  ERR_STACK_OVERFLOW = -3,
+  ERR_STACK_UNDERFLOW = -4,
+  ERR_RSTACK_OVERFLOW = -5,
+  ERR_RSTACK_UNDERFLOW = -6,
+  ERR_LOOP_DEPTH = -7,
+  ERR_DICT_OVERFLOW = -8,
+  ERR_ADDRESS = -9,
+  ERR_DIV_ZERO = -10,
+  ERR_RANGE = -11,
+  ERR_UNDEFINED = -13,
+  ERR_COMPILE_ONLY = -14,
+  ERR_FORGET = -15,
+  ERR_NO_NAME = -16,
+  ERR_NAME_LONG = -19,
+  ERR_CONTROL = -22,
+  ERR_ARG = -24,
+  ERR_IO = -37,
+  ERR_FSTACK_OVERFLOW = -44,
+  ERR_FSTACK_UNDERFLOW = -45,
+  ERR_ORDER_OVERFLOW = -49,
+  ERR_ORDER_UNDERFLOW = -50,
+  ERR_ALLOCATE = -59,
+  ERR_FREE = -60,
+  ERR_RESIZE = -61,
+};
+
+// What running a word needs is kept apart from what only the compiler and
+// see look at, so the inner interpreter walks a dense array of these and
+// never touches names. Bodies of colon definitions live in code.
+typedef struct Xt {
+  func fn;
+  cell body; // where the word's cells start in code
+} Xt;
 
 typedef struct Word {
-  cell def_len;
+  cell def_len; // cells in the body, not counting the closing exit
   char name[16];
   bool immediate;
-  func enter;
-  cell def[DEF_N]; // indexes
+  cell operands; // cells compiled inline after a call to this word
+  bool parses;   // reads the input stream, directly or through a callee
+  bool relinks;  // changes what names resolve to, directly or through a callee
+  cell wid;      // wordlist the word belongs to
+  cell link;     // next older word in the same hash bucket, or -1
+  cell here;     // memtop when the word was defined, forget goes back to it
+  signed char pure_in, pure_out; // cells a pure word takes and leaves
 } Word;
 
 typedef struct {
-  int data[STACKSIZE];
+  cell *data; // STACKSIZE cells, see stack_mem, fewer for a task
   int sp;
+  int max; // highest sp a push may reach
 } Stack;
 
+typedef struct {
+  fcell *data;
+  int sp;
+  int max;
+} FStack;
+
+static Xt *xts;
 static Word *dict;
+static cell *code;
+static cell code_top = 0;
 static cell *membank;
-static int top_word = -1;
-static char *inputbuff;
-cell inputidx = 0;
+static cell top_word = -1;
+static const char *inputbuff = "";
+static size_t inputlen = 0;
+static size_t inputidx = 0;
 static char next_word[16];
-static char lookahead_word[16];
 static cell memtop = 0;
+static cell flit_xt;
+#define EXIT_XT 1
+static cell boot_code; // code below this holds the line cache
 
-bool state = 0;
-cell wordindef = 0;
+static bool state = 0;
+static cell wordindef = 0;
+static cell last_call = -1; // last call compiled, may turn into a tail call
+// the colon definition being compiled stays hidden until ; so that a
+// redefinition can call the word it replaces
+static cell hidden = -1;
+// data stack depth at :, control flow leaves its entries above it
+static int def_sp = -1;
+// code_top and memtop at :, an abandoned definition gives both back
+static cell def_code, def_mem;
+// locals of the definition being compiled, in the order { named them
+static char local_names[LOCAL_N][NAMELEN];
+static cell local_n = 0;
+static cell locals_xt, local_fetch_xt, local_store_xt, unlocals_xt;
+// bumped on every change to what names resolve to
+static unsigned dict_gen = 1;
 
-int pcount = 0;
+static int pcount = 0;
 
-char *advance() {
-  while (isspace(inputbuff[inputidx]) && inputbuff[inputidx] != '\0')
+static char *advance() {
+  while (inputidx < inputlen && isspace(inputbuff[inputidx]))
     inputidx++;
 
   int i = 0;
-  while (!isspace(inputbuff[inputidx + i]) && inputbuff[inputidx + i] != '\0' &&
+  while (inputidx + i < inputlen && !isspace(inputbuff[inputidx + i]) &&
          i < 15) {
     i++;
   }
@@ -114,7 +305,22 @@ char *advance() {
   return next_word;
 }
 
-int char_to_int(char c) {
+// the next whitespace delimited token whatever its length, where advance
+// cuts names short. Returns its length and leaves start pointing at it.
+static size_t parse_name(const char **start) {
+  while (inputidx < inputlen && isspace(inputbuff[inputidx])) {
+    inputidx++;
+  }
+  *start = inputbuff + inputidx;
+  size_t n = 0;
+  while (inputidx < inputlen && !isspace(inputbuff[inputidx])) {
+    inputidx++;
+    n++;
+  }
+  return n;
+}
+
+static int char_to_int(char c) {
   if (isdigit(c))
     return c - '0';
   else if (isalpha(c)) {
@@ -123,8 +329,8 @@ int char_to_int(char c) {
     return -2; // Invalid character
 }
 
-int parse_num(char *str, int base, int *num) {
-  int result = 0;
+static int parse_num(char *str, int base, cell *num) {
+  cell result = 0;
   int index = 0;
   int sign = 1;
 
@@ -153,873 +359,4098 @@ int parse_num(char *str, int base, int *num) {
   return 1;
 }
 
-int lookahead_idx;
-char *lookahead() {
-  lookahead_idx = inputidx;
-  while (isspace(lookahead_word[lookahead_idx]) &&
-         lookahead_word[lookahead_idx] != '\0')
-    lookahead_idx++;
+// every thread runs words against its own stacks, the interpreter's are these
+static Stack main_ds = {.sp = -1};
+static Stack main_rs = {.sp = -1};
+static _Thread_local Stack *ds = &main_ds;
+static _Thread_local Stack *rs = &main_rs;
+static FStack main_fs = {.sp = -1};
+static _Thread_local FStack *fs = &main_fs;
+// DO loops keep their limit and index here, index on top
+static Stack main_ls = {.sp = -1};
+static _Thread_local Stack *ls = &main_ls;
 
-  int i = 0;
-  while (!isspace(lookahead_word[lookahead_idx + i]) &&
-         lookahead_word[lookahead_idx + i] != '\0' && i < 15) {
-    i++;
-  }
-  if (i)
-    memcpy(next_word, &lookahead_word[lookahead_idx], i);
-  next_word[i] = '\0';
-  lookahead_idx += i;
+// With MORTH_GUARD the stacks sit between inaccessible pages, so pushes and
+// pops skip their bounds checks and an overflow or underflow faults
+// instead. on_fault turns the fault into the matching throw. With 32-bit
+// cells every address a cell can hold falls inside a reservation around
+// membank, so @ and ! go unchecked too.
+static size_t page;
 
-  if (strcmp(next_word, "(") == 0) {
-    pcount++;
-    printf("parent: %s, %i\n", next_word, pcount);
-    lookahead();
-  } else if (strcmp(next_word, ")") == 0) {
-    pcount--;
-    printf("parent: %s, %i\n", next_word, pcount);
-    if (pcount != 0)
-      lookahead();
-    lookahead();
-  }
+#ifdef MORTH_GUARD
+#if CELL_BITS == 32
+#define MEM_GUARD
+#endif
 
-  return lookahead_word;
+static size_t stack_len(void) {
+  return (STACKSIZE * sizeof(cell) + page - 1) / page * page;
 }
 
-static Stack ds = {.data = {0}, .sp = -1};
-static Stack rs = {.data = {0}, .sp = -1};
-
-int pop_int(int *err) {
-  if (ds.sp < 0) {
-    *err = -1;
-    return 0;
+static void *stack_mem(void) {
+  size_t len = stack_len();
+  char *m = mmap(NULL, len + 2 * page, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (m == MAP_FAILED || mprotect(m + page, len, PROT_READ | PROT_WRITE)) {
+    perror("morth: stack");
+    exit(1);
   }
-  *err = 1;
-  int data = ds.data[ds.sp--];
-  return data;
+  return m + page;
 }
 
-dcell pop_int2(int *err) {
-  if (ds.sp < 1) {
-    *err = -1;
-    return 0;
+// code for a fault at a inside one of the guard pages around data
+static cell stack_fault(void *data, char *a, cell over, cell under) {
+  char *lo = data, *hi = lo + stack_len();
+  if (a >= hi && a < hi + page) {
+    return over;
   }
-  *err = 1;
-  cell high = ds.data[ds.sp--];
-  cell low = ds.data[ds.sp--];
-  return ((cell)low | ((dcell)(high) << (sizeof(cell) * 8)));
+  return a >= lo - page && a < lo ? under : 0;
 }
+#else
+static void *stack_mem(void) { return malloc(STACKSIZE * sizeof(cell)); }
+#endif
 
-int push_int2(dcell to_push) {
-  if (ds.sp >= STACKSIZE) {
-    return -2;
+// Stacks start out painted so stack_high can tell how deep one has ever
+// been without pushes keeping count
+#define PAINT ((cell)0x5eed5eed)
+
+static void stack_init(Stack *s) {
+  s->data = stack_mem();
+  s->sp = -1;
+  s->max = STACKSIZE - 1;
+  for (int i = 0; i <= s->max; i++) {
+    s->data[i] = PAINT;
   }
-  cell high = (cell)(to_push >> 32);       // Extracting the first 32 bits
-  cell low = (cell)(to_push & 0xFFFFFFFF); // Extracting the last 32 bits
-  ds.data[++ds.sp] = low;
-  ds.data[++ds.sp] = high;
-  return 1;
 }
 
-int push_int(int to_push) {
-  if (ds.sp >= STACKSIZE) {
-    return -2;
+// most cells s has held, give or take a pushed cell that equals PAINT
+static cell stack_high(const Stack *s) {
+  cell i = s->max;
+  while (i >= 0 && s->data[i] == PAINT) {
+    i--;
   }
-  ds.data[++ds.sp] = to_push;
-  return 1;
+  return i + 1;
+}
+
+static void fstack_init(FStack *s) {
+  s->data = stack_mem();
+  s->sp = -1;
+  s->max = STACKSIZE - 1;
 }
 
-cell popr_int(cell *err) {
-  if (rs.sp < 0) {
-    *err = -1;
+// a catch frame remembers the stacks to unwind to. throw_err jumps to the
+// innermost one, so primitives only deal with errors where they happen.
+typedef struct Catch {
+  jmp_buf jmp;
+  struct Catch *prev;
+  Stack *ds, *rs, *ls;
+  FStack *fs;
+  int ds_sp, rs_sp, ls_sp, fs_sp, nest;
+  cell ip;
+} Catch;
+
+static _Thread_local Catch *handler = NULL;
+static _Thread_local int run_nest = 0; // step loops running on this thread
+
+static _Noreturn void throw_err(cell code) { longjmp(handler->jmp, code); }
+
+// runs fn(arg) in a new catch frame, returns 0 or the code thrown
+static cell guarded(void (*fn)(cell), cell arg) {
+  Catch c = {.prev = handler, .ds = ds, .rs = rs, .ls = ls, .fs = fs,
+             .ds_sp = ds->sp, .rs_sp = rs->sp, .ls_sp = ls->sp,
+             .fs_sp = fs->sp, .nest = run_nest, .ip = ip_d};
+  cell code = setjmp(c.jmp);
+  if (code == 0) {
+    handler = &c;
+    fn(arg);
+    handler = c.prev;
     return 0;
   }
-  *err = 1;
-  int data = rs.data[rs.sp--];
-  return data;
+  handler = c.prev;
+  ds = c.ds;
+  rs = c.rs;
+  ls = c.ls;
+  fs = c.fs;
+  ds->sp = c.ds_sp;
+  rs->sp = c.rs_sp;
+  ls->sp = c.ls_sp;
+  fs->sp = c.fs_sp;
+  run_nest = c.nest;
+  ip_d = c.ip;
+  return code;
 }
 
-cell pushr_int(cell to_push) {
-  if (rs.sp >= STACKSIZE) {
-    return -2;
+static cell pop_int() {
+#ifndef MORTH_GUARD
+  if (ds->sp < 0) {
+    throw_err(ERR_STACK_UNDERFLOW);
   }
-  rs.data[++rs.sp] = to_push;
-  return 1;
+#endif
+  return ds->data[ds->sp--];
 }
 
-cell balloc_int(cell size) {
-  if (size + memtop >= MEMSIZE) {
-    return -8;
+static void push_int(cell to_push) {
+#ifndef MORTH_GUARD
+  if (ds->sp >= ds->max) {
+    throw_err(ERR_STACK_OVERFLOW);
   }
-  cell r = memtop;
-  memtop += size;
-  return r;
+#endif
+  ds->data[++ds->sp] = to_push;
 }
 
-cell balloc(Word *self, Word *caller) { // returns index into membank
-  int err;
-  cell size = pop_int(&err);
-  if (err != 1) {
-    return err;
+static cell popr_int() {
+#ifndef MORTH_GUARD
+  if (rs->sp < 0) {
+    throw_err(ERR_RSTACK_UNDERFLOW);
   }
-  balloc_int(size);
-  return err = 1;
+#endif
+  return rs->data[rs->sp--];
 }
 
-cell bfree_int(cell size) {
-  if (size <= 0 || memtop - size < 0) {
-    return -8;
+static void pushr_int(cell to_push) {
+#ifndef MORTH_GUARD
+  if (rs->sp >= rs->max) {
+    throw_err(ERR_RSTACK_OVERFLOW);
   }
-  memtop -= size;
-  return 1;
+#endif
+  rs->data[++rs->sp] = to_push;
 }
 
-cell bfree(Word *self, Word *caller) { // returns index into membank
-  int err;
-  cell size = pop_int(&err);
-  if (err != 1) {
-    return err;
+static fcell pop_float() {
+#ifndef MORTH_GUARD
+  if (fs->sp < 0) {
+    throw_err(ERR_FSTACK_UNDERFLOW);
   }
-  return err = bfree_int(size);
+#endif
+  return fs->data[fs->sp--];
 }
 
-int pop(Word *word, Word *caller) {
-  if (ds.sp >= 0) {
-    ds.sp--;
-  } else {
-    return -1;
+static void push_float(fcell to_push) {
+#ifndef MORTH_GUARD
+  if (fs->sp >= fs->max) {
+    throw_err(ERR_FSTACK_OVERFLOW);
   }
-  return 1;
+#endif
+  fs->data[++fs->sp] = to_push;
 }
 
-int dot(Word *word, Word *caller) {
-  if (ds.sp >= 0) {
-    printf("%i ok \n", ds.data[ds.sp--]);
-  } else {
-    return -1;
+// a float literal needs a fraction or an exponent, so "12" stays an integer.
+// "1e" is read like "1e0", as in other forths.
+static int parse_float(char *str, fcell *num) {
+  if (!strpbrk(str, ".eE") || !strpbrk(str, "0123456789")) {
+    return -2;
   }
+  char *end;
+  double result = strtod(str, &end);
+  if ((*end == 'e' || *end == 'E') && end[1] == '\0') {
+    end++;
+  }
+  if (*end != '\0') {
+    return -2;
+  }
+  *num = result;
   return 1;
 }
 
-int add(Word *word, Word *caller) {
-  int err = 1;
-  int a = pop_int(&err);
-  if (err != 1) {
-    return err;
-  }
-  int b = pop_int(&err);
-  if (err != 1) {
-    return err;
+// The heap grows down from the top of membank while here grows up towards
+// it. Every heap block starts with a header cell holding its capacity in
+// cells, negated while the block is free. Capacities up to SMALL_MAX are
+// powers of two recycled through per-class free lists, with a few blocks
+// cached per thread. Bigger blocks go to a best-fit list and merge with a
+// free neighbour above them, and the lowest one returns to the gap.
+#define CLASS_N 8
+#define SMALL_MAX (1 << CLASS_N)
+#define TCACHE_N 8 // free blocks a thread keeps per class
+
+static struct {
+  pthread_mutex_t lock;
+  _Atomic cell low;    // lowest heap cell, MEMSIZE while the heap is empty,
+                       // changed under the lock but read without it
+  cell small[CLASS_N]; // free lists linked through the first payload cell
+  cell large;          // free list linked through the first two payload cells
+  _Atomic cell used;   // cells in live blocks, headers included
+  _Atomic uint64_t allocs, frees;
+} heap = {.lock = PTHREAD_MUTEX_INITIALIZER, .low = MEMSIZE, .large = -1};
+
+static _Thread_local struct {
+  cell head[CLASS_N];
+  int n[CLASS_N];
+} tcache = {.head = {-1, -1, -1, -1, -1, -1, -1, -1}};
+
+static cell balloc_int(cell size) {
+  if (size > heap.low - memtop || memtop + size < 0) {
+    throw_err(ERR_DICT_OVERFLOW);
   }
-  return push_int(a + b);
+  cell r = memtop;
+  memtop += size;
+  return r;
 }
 
-int add2(Word *word, Word *caller) {
-  int err = 1;
-  dcell a = pop_int2(&err);
-  if (err != 1) {
-    return err;
-  }
-  dcell b = pop_int2(&err);
-  if (err != 1) {
-    return err;
-  }
-  return push_int2(a + b);
+static void balloc(Xt *self) { // a negative size gives cells back
+  cell size = pop_int();
+  balloc_int(size);
 }
 
-int sub(Word *word, Word *caller) {
-  int err = 1;
-  int b = pop_int(&err);
-  if (err != 1) {
-    return err;
-  }
-  int a = pop_int(&err);
-  if (err != 1) {
-    return err;
+// takes cap cells and a header from the gap above here, under the lock
+static cell heap_carve(cell cap) {
+  if (heap.low - memtop <= cap) {
+    return -1;
   }
-  return push_int(a - b);
+  heap.low -= cap + 1;
+  membank[heap.low] = cap;
+  return heap.low + 1;
 }
 
-int sub2(Word *word, Word *caller) {
-  int err = 1;
-  dcell a = pop_int2(&err);
-  if (err != 1) {
-    return err;
+static void large_unlink(cell a) {
+  cell next = membank[a], prev = membank[a + 1];
+  if (prev >= 0) {
+    membank[prev] = next;
+  } else {
+    heap.large = next;
   }
-  dcell b = pop_int2(&err);
-  if (err != 1) {
-    return err;
+  if (next >= 0) {
+    membank[next + 1] = prev;
   }
-  return push_int2(a - b);
 }
 
-int mul(Word *word, Word *caller) {
-  int err = 1;
-  int b = pop_int(&err);
-  if (err != 1) {
-    return err;
-  }
-  int a = pop_int(&err);
-  if (err != 1) {
-    return err;
+static void large_push(cell a, cell cap) {
+  membank[a - 1] = -cap;
+  membank[a] = heap.large;
+  membank[a + 1] = -1;
+  if (heap.large >= 0) {
+    membank[heap.large + 1] = a;
   }
-  return push_int(a * b);
+  heap.large = a;
 }
 
-int mul2(Word *word, Word *caller) {
-  int err = 1;
-  int b = pop_int(&err);
-  if (err != 1) {
-    return err;
+static cell large_alloc(cell n) {
+  cell best = -1, best_cap = 0;
+  for (cell b = heap.large; b >= 0; b = membank[b]) {
+    cell cap = -membank[b - 1];
+    if (cap >= n && (best < 0 || cap < best_cap)) {
+      best = b;
+      best_cap = cap;
+    }
   }
-  int a = pop_int(&err);
-  if (err != 1) {
-    return err;
+  if (best < 0) {
+    return heap_carve(n);
+  }
+  large_unlink(best);
+  if (best_cap - n - 1 > SMALL_MAX) { // the rest stays a large free block
+    large_push(best + n + 1, best_cap - n - 1);
+    best_cap = n;
   }
-  return push_int(a * b);
+  membank[best - 1] = best_cap;
+  return best;
 }
 
-int divide(Word *word, Word *caller) {
-  int err = 1;
-  dcell b = pop_int2(&err);
-  if (err != 1) {
-    return err;
+// address of at least n free cells, or -1
+static cell heap_alloc(cell n) {
+  if (n < 0) {
+    return -1;
   }
-  dcell a = pop_int2(&err);
-  if (err != 1) {
-    return err;
+  cell a;
+  if (n <= SMALL_MAX) {
+    int c = 0;
+    while ((2 << c) < n) {
+      c++;
+    }
+    if (tcache.head[c] >= 0) {
+      a = tcache.head[c];
+      tcache.head[c] = membank[a];
+      tcache.n[c]--;
+    } else {
+      pthread_mutex_lock(&heap.lock);
+      a = heap.small[c];
+      if (a >= 0) {
+        heap.small[c] = membank[a];
+      } else {
+        a = heap_carve(2 << c);
+      }
+      pthread_mutex_unlock(&heap.lock);
+      if (a < 0) {
+        return -1;
+      }
+    }
+    membank[a - 1] = 2 << c;
+  } else {
+    pthread_mutex_lock(&heap.lock);
+    a = large_alloc(n);
+    pthread_mutex_unlock(&heap.lock);
+    if (a < 0) {
+      return -1;
+    }
   }
-  return push_int2(a / b);
+  heap.used += membank[a - 1] + 1;
+  heap.allocs++;
+  return a;
 }
 
-int divide2(Word *word, Word *caller) {
-  int err = 1;
-  int b = pop_int(&err);
-  if (err != 1) {
-    return err;
-  }
-  int a = pop_int(&err);
-  if (err != 1) {
-    return err;
+// capacity of the live block at a, or -1
+static cell heap_cap(cell a) {
+  if (a <= heap.low || a >= MEMSIZE) {
+    return -1;
   }
-  return push_int(a / b);
+  cell cap = membank[a - 1];
+  return cap > 0 && cap <= MEMSIZE - a ? cap : -1;
 }
 
-int mod(Word *word, Word *caller) {
-  int err = 1;
-  int b = pop_int(&err);
-  if (err != 1) {
-    return err;
+static cell heap_free(cell a) {
+  cell cap = heap_cap(a);
+  if (cap < 0) {
+    return -1;
   }
-  int a = pop_int(&err);
-  if (err != 1) {
-    return err;
+  heap.used -= cap + 1;
+  heap.frees++;
+  if (cap <= SMALL_MAX) {
+    int c = __builtin_ctz(cap) - 1;
+    membank[a - 1] = -cap;
+    if (tcache.n[c] < TCACHE_N) {
+      membank[a] = tcache.head[c];
+      tcache.head[c] = a;
+      tcache.n[c]++;
+    } else {
+      pthread_mutex_lock(&heap.lock);
+      membank[a] = heap.small[c];
+      heap.small[c] = a;
+      pthread_mutex_unlock(&heap.lock);
+    }
+    return 0;
   }
-  if (b == 0) {
-    return -2;
+  pthread_mutex_lock(&heap.lock);
+  cell above = a + cap + 1;
+  while (above < MEMSIZE && -membank[above - 1] > SMALL_MAX) {
+    large_unlink(above);
+    cap += -membank[above - 1] + 1;
+    above = a + cap + 1;
   }
-  return push_int(a % b);
-  return 1;
+  if (a - 1 == heap.low) {
+    heap.low = above - 1;
+  } else {
+    large_push(a, cap);
+  }
+  pthread_mutex_unlock(&heap.lock);
+  return 0;
 }
 
-int mod2(Word *word, Word *caller) {
-  int err = 1;
-  dcell b = pop_int2(&err);
-  if (err != 1) {
-    return err;
+// ( u -- a-addr ior ) u and a-addr count cells
+static void allocate(Xt *self) {
+  cell a = heap_alloc(pop_int());
+  push_int(a < 0 ? 0 : a);
+  push_int(a < 0 ? ERR_ALLOCATE : 0);
+}
+
+// ( a-addr -- ior )
+static void heap_free_word(Xt *self) {
+  push_int(heap_free(pop_int()) < 0 ? ERR_FREE : 0);
+}
+
+// ( a-addr1 u -- a-addr2 ior ) a block only ever moves to grow
+static void resize(Xt *self) {
+  cell n = pop_int();
+  cell a = pop_int();
+  cell cap = heap_cap(a);
+  if (cap < 0 || n < 0) {
+    push_int(a);
+    push_int(ERR_RESIZE);
+    return;
   }
-  dcell a = pop_int2(&err);
-  if (err != 1) {
-    return err;
+  if (n <= cap) {
+    push_int(a);
+    push_int(0);
+    return;
   }
-  if (b == 0) {
-    return -2;
+  cell b = heap_alloc(n);
+  if (b < 0) {
+    push_int(a);
+    push_int(ERR_RESIZE);
+    return;
   }
-  return push_int2(a % b);
-  return 1;
+  memcpy(&membank[b], &membank[a], cap * sizeof(cell));
+  heap_free(a);
+  push_int(b);
+  push_int(0);
 }
 
-int gth(Word *word, Word *caller) {
-  int err = 1;
-  int b = pop_int(&err);
-  if (err != 1) {
-    return err;
-  }
-  int a = pop_int(&err);
-  if (err != 1) {
-    return err;
+// ( -- size used free largest ) size is everything the heap has taken from
+// membank, free what is in free lists, largest the biggest large free block
+static void heap_stats(Xt *self) {
+  pthread_mutex_lock(&heap.lock);
+  cell size = MEMSIZE - heap.low, largest = 0;
+  for (cell b = heap.large; b >= 0; b = membank[b]) {
+    if (-membank[b - 1] > largest) {
+      largest = -membank[b - 1];
+    }
   }
-  return push_int(a > b);
+  pthread_mutex_unlock(&heap.lock);
+  push_int(size);
+  push_int(heap.used);
+  push_int(size - heap.used);
+  push_int(largest);
 }
 
-int gth2(Word *word, Word *caller) {
-  int err = 1;
-  int b = pop_int2(&err);
-  if (err != 1) {
-    return err;
-  }
-  int a = pop_int2(&err);
-  if (err != 1) {
-    return err;
+// Files are mapped into membank addresses above MEMSIZE, inside the same
+// reservation, so @ and the bulk words reach them like any other cells.
+// Addresses outside membank are checked against this table.
+enum { MAP_RO, MAP_COW, MAP_WAV16 };
+
+typedef struct {
+  cell at, cells; // membank cells covered, no cells when the slot is free
+  cell ret;       // address map-file gave out, unmap takes it back
+  bool writable;
+} Mapping;
+
+static Mapping maps[MAP_N];
+
+static bool mapped(cell addr, cell n, bool write) {
+  for (int i = 0; i < MAP_N; i++) {
+    Mapping *m = &maps[i];
+    if (m->cells && addr >= m->at && n >= 0 &&
+        n <= m->at + m->cells - addr && (m->writable || !write)) {
+      return true;
+    }
   }
-  return push_int2(a > b);
+  return false;
 }
 
-int lth(Word *word, Word *caller) {
-  int err = 1;
-  int b = pop_int(&err);
-  if (err != 1) {
-    return err;
-  }
-  int a = pop_int(&err);
-  if (err != 1) {
-    return err;
+// lowest page aligned run of n free cells above membank, or -1
+static cell map_space(cell n) {
+  cell page_cells = page / sizeof(cell);
+  cell at = (MEMSIZE + page_cells - 1) / page_cells * page_cells;
+  for (int i = 0; i < MAP_N; i++) {
+    bool clash = false;
+    for (int j = 0; j < MAP_N; j++) {
+      Mapping *m = &maps[j];
+      if (m->cells && at < m->at + m->cells && m->at < at + n) {
+        at = (m->at + m->cells + page_cells - 1) / page_cells * page_cells;
+        clash = true;
+      }
+    }
+    if (!clash) {
+      return at <= MEMSIZE + MAP_CELLS - n ? at : -1;
+    }
   }
-  return push_int(a < b);
+  return -1;
 }
 
-int lth2(Word *word, Word *caller) {
-  int err = 1;
-  int b = pop_int2(&err);
-  if (err != 1) {
-    return err;
+static void check_range(cell addr, cell n, bool write);
+
+// the n characters at addr, one per cell as s" leaves them
+static void cell_string(cell addr, cell n, char *buf, size_t size) {
+  check_range(addr, n, false);
+  if (n >= (cell)size) {
+    throw_err(ERR_NAME_LONG);
   }
-  int a = pop_int2(&err);
-  if (err != 1) {
-    return err;
+  for (cell i = 0; i < n; i++) {
+    buf[i] = membank[addr + i];
   }
-  return push_int(a < b);
+  buf[n] = '\0';
 }
 
-int dup(Word *word, Word *caller) {
-  int err = 1;
-  int a = pop_int(&err);
-  if (err != 1) {
-    return err;
-  }
-  err = push_int(a);
-  if (err != 1) {
-    return err;
+static uint32_t le(const unsigned char *p, int n) {
+  uint32_t v = 0;
+  while (n--) {
+    v = v << 8 | p[n];
   }
-  err = push_int(a);
-  return err;
+  return v;
 }
 
-int swp(Word *word, Word *caller) {
-  int err = 1;
-  int b = pop_int(&err);
-  if (err != 1) {
-    return err;
-  }
-  int a = pop_int(&err);
-  if (err != 1) {
-    return err;
-  }
-  err = push_int(b);
-  if (err != 1) {
-    return err;
+// finds the samples of a 16-bit PCM RIFF file, false if it isn't one
+static bool wav16_data(const unsigned char *f, size_t len, size_t *off,
+                       size_t *size) {
+  if (len < 12 || memcmp(f, "RIFF", 4) || memcmp(f + 8, "WAVE", 4)) {
+    return false;
   }
-  err = push_int(a);
-  if (err != 1) {
-    return err;
+  bool pcm16 = false;
+  for (size_t at = 12; at + 8 <= len;) {
+    size_t n = le(f + at + 4, 4);
+    if (!memcmp(f + at, "fmt ", 4) && n >= 16 && at + 24 <= len) {
+      pcm16 = le(f + at + 8, 2) == 1 && le(f + at + 22, 2) == 16;
+    } else if (!memcmp(f + at, "data", 4)) {
+      *off = at + 8;
+      *size = n < len - *off ? n : len - *off;
+      return pcm16;
+    }
+    at += 8 + n + (n & 1);
   }
-  return 1;
+  return false;
 }
 
-int rot(Word *word, Word *caller) {
-  int err = 1;
-  int x3 = pop_int(&err);
-  if (err != 1) {
-    return err;
+// ( name len mode -- addr len ) r/o and cow give cells, wav16 gives the
+// samples for w@: 16-bit units counted from membank address 0
+static void map_file(Xt *self) {
+  cell mode = pop_int();
+  cell n = pop_int();
+  cell name_addr = pop_int();
+  char name[256];
+  cell_string(name_addr, n, name, sizeof(name));
+  if (mode < MAP_RO || mode > MAP_WAV16) {
+    throw_err(ERR_ARG);
   }
-  int x2 = pop_int(&err);
-  if (err != 1) {
-    return err;
+  Mapping *m = maps;
+  while (m < maps + MAP_N && m->cells) {
+    m++;
   }
-  int x1 = pop_int(&err);
-  if (err != 1) {
-    return err;
+  if (m == maps + MAP_N) {
+    throw_err(ERR_ALLOCATE);
   }
-  err = push_int(x2);
-  if (err != 1) {
-    return err;
+  int fd = open(name, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) || st.st_size == 0) {
+    if (fd >= 0)
+      close(fd);
+    throw_err(ERR_IO);
   }
-  err = push_int(x3);
-  if (err != 1) {
-    return err;
+  size_t bytes = st.st_size;
+  cell cells = (bytes + sizeof(cell) - 1) / sizeof(cell);
+  cell at = cells <= MAP_CELLS ? map_space(cells) : -1;
+  if (at < 0) {
+    close(fd);
+    throw_err(ERR_ALLOCATE);
   }
-  err = push_int(x1);
-  if (err != 1) {
-    return err;
+  int prot = mode == MAP_COW ? PROT_READ | PROT_WRITE : PROT_READ;
+  void *p = mmap(membank + at, bytes, prot, MAP_PRIVATE | MAP_FIXED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    throw_err(ERR_IO);
+  }
+  size_t off, size;
+  if (mode == MAP_WAV16 && !wav16_data(p, bytes, &off, &size)) {
+    mmap(p, cells * sizeof(cell), PROT_NONE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+    throw_err(ERR_IO);
+  }
+  m->at = at;
+  m->cells = cells;
+  m->writable = mode == MAP_COW;
+  if (mode == MAP_WAV16) {
+    m->ret = (at * sizeof(cell) + off) / 2;
+    push_int(m->ret);
+    push_int(size / 2);
+  } else {
+    m->ret = at;
+    push_int(at);
+    push_int(cells);
   }
-  return 1;
 }
 
-int ovr(Word *word, Word *caller) {
-  int err = 1;
-  int b = pop_int(&err);
-  if (err != 1) {
-    return err;
+// ( addr -- ) takes the address map-file gave
+static void unmap(Xt *self) {
+  cell addr = pop_int();
+  for (Mapping *m = maps; m < maps + MAP_N; m++) {
+    if (m->cells && m->ret == addr) {
+      // back to reserved address space, so stray accesses still fault
+      mmap(membank + m->at, m->cells * sizeof(cell), PROT_NONE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+      m->cells = 0;
+      return;
+    }
   }
-  int a = pop_int(&err);
-  if (err != 1) {
-    return err;
+  throw_err(ERR_ARG);
+}
+
+static void map_ro(Xt *self) { push_int(MAP_RO); }
+
+static void map_cow(Xt *self) { push_int(MAP_COW); }
+
+static void map_wav16(Xt *self) { push_int(MAP_WAV16); }
+
+// w@ and w! address membank in signed 16-bit units
+#define W_PER_CELL ((cell)(sizeof(cell) / 2))
+
+static void wfetch(Xt *self) {
+  cell w = pop_int();
+#ifndef MEM_GUARD
+  if ((w < 0 || w / W_PER_CELL >= MEMSIZE) &&
+      !mapped(w / W_PER_CELL, 1, false)) {
+    throw_err(ERR_ADDRESS);
   }
-  err = push_int(a);
-  if (err != 1) {
-    return err;
+#endif
+  push_int(((int16_t *)membank)[w]);
+}
+
+static void wstore(Xt *self) {
+  cell w = pop_int();
+  cell data = pop_int();
+#ifndef MEM_GUARD
+  if ((w < 0 || w / W_PER_CELL >= MEMSIZE) &&
+      !mapped(w / W_PER_CELL, 1, true)) {
+    throw_err(ERR_ADDRESS);
   }
-  err = push_int(b);
-  if (err != 1) {
-    return err;
+#endif
+  ((int16_t *)membank)[w] = data;
+}
+
+static void pop(Xt *self) {
+  if (ds->sp >= 0) {
+    ds->sp--;
+  } else {
+    throw_err(ERR_STACK_UNDERFLOW);
   }
-  err = push_int(a);
-  if (err != 1) {
-    return err;
+}
+
+// Output collects in a buffer per thread and goes to stdout when it fills,
+// at each newline when stdout is a terminal, after a render job and at exit.
+static _Thread_local struct {
+  char *buf; // OUT_N bytes, allocated on first use
+  size_t n;
+} outbuf;
+static bool out_tty;
+static cell base_addr; // membank cell holding the base numbers print in
+
+static void out_flush(void) {
+  if (outbuf.n) {
+    fwrite(outbuf.buf, 1, outbuf.n, stdout);
+    fflush(stdout);
+    outbuf.n = 0;
   }
-  return 1;
 }
 
-int or (Word * word, Word *caller) {
-  cell err = 1;
-  cell b = pop_int(&err);
-  if (err != 1) {
-    return err;
+static void out_write(const char *s, size_t n) {
+  if (!outbuf.buf) {
+    outbuf.buf = malloc(OUT_N);
   }
-  cell a = pop_int(&err);
-  if (err != 1) {
-    return err;
+  if (n > OUT_N - outbuf.n) {
+    out_flush();
+    if (n > OUT_N) {
+      fwrite(s, 1, n, stdout);
+      fflush(stdout);
+      return;
+    }
   }
-  err = push_int(a != 0 || b != 0);
-  if (err != 1) {
-    return err;
+  memcpy(outbuf.buf + outbuf.n, s, n);
+  outbuf.n += n;
+  if (out_tty && memchr(s, '\n', n)) {
+    out_flush();
   }
-  return 1;
 }
-int and (Word * word, Word *caller) {
-  cell err = 1;
-  cell b = pop_int(&err);
-  if (err != 1) {
-    return err;
-  }
-  cell a = pop_int(&err);
-  if (err != 1) {
-    return err;
-  }
-  err = push_int(a != 0 && b != 0);
-  if (err != 1) {
-    return err;
+
+static void out_char(char c) {
+  if (outbuf.buf && outbuf.n < OUT_N && !(out_tty && c == '\n')) {
+    outbuf.buf[outbuf.n++] = c;
+  } else {
+    out_write(&c, 1);
   }
-  return 1;
 }
 
-int jmp(Word *word, Word *caller) {
-  int err = 1;
-  int pos = pop_int(&err);
-  if (err != 1) {
-    return err;
+static void out_printf(const char *fmt, ...) {
+  char buf[256];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  out_write(buf, n < (int)sizeof(buf) ? n : (int)sizeof(buf) - 1);
+}
+
+// u in base followed by a space, negated first when neg
+static void out_number(ucell u, bool neg) {
+  cell base = membank[base_addr];
+  if (base < 2 || base > 36) {
+    membank[base_addr] = 10;
+    throw_err(ERR_ARG);
   }
-  if (pos < 0) {
-    return -5;
+  char buf[CELL_BITS + 2];
+  char *p = buf + sizeof(buf);
+  *--p = ' ';
+  if (neg) {
+    u = -u;
   }
-  popr_int(&err);
+  if (base == 10) { // a constant divisor becomes a multiply
+    do {
+      *--p = '0' + u % 10;
+      u /= 10;
+    } while (u);
+  } else {
+    do {
+      cell d = u % base;
+      *--p = d < 10 ? '0' + d : 'a' + d - 10;
+      u /= base;
+    } while (u);
+  }
+  if (neg) {
+    *--p = '-';
+  }
+  out_write(p, buf + sizeof(buf) - p);
+}
 
-  if (err != 1) {
-    return err;
+static void dot(Xt *self) {
+  cell n = pop_int();
+  out_number(n, n < 0);
+}
+
+static void udot(Xt *self) { out_number(pop_int(), false); }
+
+static void emit_char(Xt *self) { out_char(pop_int()); }
+
+static void cr(Xt *self) { out_char('\n'); }
+
+// ( addr len -- ) prints the characters in len cells
+static void type(Xt *self) {
+  cell n = pop_int();
+  cell addr = pop_int();
+  check_range(addr, n, false);
+  for (cell i = 0; i < n; i++) {
+    out_char(membank[addr + i]);
   }
-  pushr_int(pos - 1);
+}
 
-  return 1;
+static void base(Xt *self) { push_int(base_addr); }
+
+static void hex(Xt *self) { membank[base_addr] = 16; }
+
+static void decimal(Xt *self) { membank[base_addr] = 10; }
+
+static void add(Xt *self) {
+  cell a = pop_int();
+  cell b = pop_int();
+  push_int(a + b);
 }
 
-int jmpz(Word *word, Word *caller) {
-  int err = 1;
-  int condition = pop_int(&err);
-  if (err != 1) {
-    return err;
+static void sub(Xt *self) {
+  cell b = pop_int();
+  cell a = pop_int();
+  push_int(a - b);
+}
+
+static void mul(Xt *self) {
+  cell b = pop_int();
+  cell a = pop_int();
+  push_int(a * b);
+}
+
+static void divide(Xt *self) {
+  cell b = pop_int();
+  cell a = pop_int();
+  if (b == 0) {
+    throw_err(ERR_DIV_ZERO);
   }
-  int pos = pop_int(&err);
-  if (err != 1) {
-    return err;
+  if (a == CELL_MIN && b == -1) {
+    throw_err(ERR_RANGE); // the quotient doesn't fit, x86 traps on it
+  }
+  push_int(a / b);
+}
+
+static void mod(Xt *self) {
+  cell b = pop_int();
+  cell a = pop_int();
+  if (b == 0) {
+    throw_err(ERR_DIV_ZERO);
+  }
+  if (a == CELL_MIN && b == -1) {
+    throw_err(ERR_RANGE); // the quotient doesn't fit, x86 traps on it
+  }
+  push_int(a % b);
+}
+
+static void gth(Xt *self) {
+  cell b = pop_int();
+  cell a = pop_int();
+  push_int(a > b);
+}
+
+static void lth(Xt *self) {
+  cell b = pop_int();
+  cell a = pop_int();
+  push_int(a < b);
+}
+
+// a double cell is two stack cells, low cell first. On a little-endian host
+// that is exactly how a dcell is laid out, so the double words load and store
+// their operands where they sit on the stack.
+static inline dcell dcell_at(const cell *p) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  dcell d;
+  memcpy(&d, p, sizeof(dcell));
+  return d;
+#else
+  return (dcell)((udcell)(ucell)p[1] << CELL_BITS | (ucell)p[0]);
+#endif
+}
+
+static inline void dcell_put(cell *p, dcell d) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(p, &d, sizeof(dcell));
+#else
+  p[0] = (cell)d;
+  p[1] = (cell)((udcell)d >> CELL_BITS);
+#endif
+}
+
+#define DOUBLE_OP2(_name, _expr)                                               \
+  static void _name(Xt *self) {                                \
+    if (ds->sp < 3) {                                                          \
+      throw_err(ERR_STACK_UNDERFLOW);                                          \
+    }                                                                          \
+    cell *p = &ds->data[ds->sp - 3];                                           \
+    dcell a = dcell_at(p), b = dcell_at(p + 2);                                \
+    dcell_put(p, _expr);                                                       \
+    ds->sp -= 2;                                                               \
+  }
+
+#define DOUBLE_CMP(_name, _expr)                                               \
+  static void _name(Xt *self) {                                \
+    if (ds->sp < 3) {                                                          \
+      throw_err(ERR_STACK_UNDERFLOW);                                          \
+    }                                                                          \
+    cell *p = &ds->data[ds->sp - 3];                                           \
+    dcell a = dcell_at(p), b = dcell_at(p + 2);                                \
+    p[0] = _expr;                                                              \
+    ds->sp -= 3;                                                               \
+  }
+
+DOUBLE_OP2(add2, (dcell)((udcell)a + (udcell)b))
+DOUBLE_OP2(sub2, (dcell)((udcell)a - (udcell)b))
+DOUBLE_OP2(mul2, (dcell)((udcell)a * (udcell)b))
+DOUBLE_CMP(lth2, a < b)
+DOUBLE_CMP(gth2, a > b)
+
+static void divide2(Xt *self) {
+  if (ds->sp < 3) {
+    throw_err(ERR_STACK_UNDERFLOW);
+  }
+  cell *p = &ds->data[ds->sp - 3];
+  dcell a = dcell_at(p), b = dcell_at(p + 2);
+  if (b == 0) {
+    throw_err(ERR_DIV_ZERO);
+  }
+  if (a == DCELL_MIN && b == -1) {
+    throw_err(ERR_RANGE);
+  }
+  dcell_put(p, a / b);
+  ds->sp -= 2;
+}
+
+static void mod2(Xt *self) {
+  if (ds->sp < 3) {
+    throw_err(ERR_STACK_UNDERFLOW);
+  }
+  cell *p = &ds->data[ds->sp - 3];
+  dcell a = dcell_at(p), b = dcell_at(p + 2);
+  if (b == 0) {
+    throw_err(ERR_DIV_ZERO);
+  }
+  if (a == DCELL_MIN && b == -1) {
+    throw_err(ERR_RANGE);
+  }
+  dcell_put(p, a % b);
+  ds->sp -= 2;
+}
+
+static void dupe(Xt *self) {
+  cell a = pop_int();
+  push_int(a);
+  push_int(a);
+}
+
+static void swp(Xt *self) {
+  cell b = pop_int();
+  cell a = pop_int();
+  push_int(b);
+  push_int(a);
+}
+
+static void rot(Xt *self) {
+  cell x3 = pop_int();
+  cell x2 = pop_int();
+  cell x1 = pop_int();
+  push_int(x2);
+  push_int(x3);
+  push_int(x1);
+}
+
+static void ovr(Xt *self) {
+  cell b = pop_int();
+  cell a = pop_int();
+  push_int(a);
+  push_int(b);
+  push_int(a);
+}
+
+static void or (Xt *self) {
+  cell b = pop_int();
+  cell a = pop_int();
+  push_int(a != 0 || b != 0);
+}
+static void and (Xt *self) {
+  cell b = pop_int();
+  cell a = pop_int();
+  push_int(a != 0 && b != 0);
+}
+
+// floats live on their own stack, f@ and f! share membank with cells
+#define FLOAT_OP2(_name, _expr)                                                \
+  static void _name(Xt *self) {                                \
+    fcell b = pop_float();                                                     \
+    fcell a = pop_float();                                                     \
+    push_float(_expr);                                                         \
+  }
+
+#define FLOAT_OP1(_name, _expr)                                                \
+  static void _name(Xt *self) {                                \
+    fcell a = pop_float();                                                     \
+    push_float(_expr);                                                         \
+  }
+
+FLOAT_OP2(fadd, a + b)
+FLOAT_OP2(fsub, a - b)
+FLOAT_OP2(fmul, a * b)
+FLOAT_OP2(fdiv, a / b)
+FLOAT_OP1(fsine, sin(a))
+FLOAT_OP1(fexpo, exp(a))
+FLOAT_OP1(fsqroot, sqrt(a))
+FLOAT_OP1(fnegate, -a)
+
+static void fdup(Xt *self) {
+  if (fs->sp < 0) {
+    throw_err(ERR_FSTACK_UNDERFLOW);
+  }
+  push_float(fs->data[fs->sp]);
+}
+
+static void fdrop(Xt *self) {
+  if (fs->sp < 0) {
+    throw_err(ERR_FSTACK_UNDERFLOW);
+  }
+  fs->sp--;
+}
+
+static void fswap(Xt *self) {
+  if (fs->sp < 1) {
+    throw_err(ERR_FSTACK_UNDERFLOW);
+  }
+  fcell a = fs->data[fs->sp];
+  fs->data[fs->sp] = fs->data[fs->sp - 1];
+  fs->data[fs->sp - 1] = a;
+}
+
+static void fover(Xt *self) {
+  if (fs->sp < 1) {
+    throw_err(ERR_FSTACK_UNDERFLOW);
+  }
+  push_float(fs->data[fs->sp - 1]);
+}
+
+static void fdot(Xt *self) {
+  fcell a = pop_float();
+  out_printf("%g ", (double)a);
+}
+
+static void flth(Xt *self) {
+  fcell b = pop_float();
+  fcell a = pop_float();
+  push_int(a < b);
+}
+
+static void int_to_float(Xt *self) {
+  cell a = pop_int();
+  push_float(a);
+}
+
+static void float_to_int(Xt *self) {
+  fcell a = pop_float();
+  push_int((cell)a);
+}
+
+static void float_read(Xt *self) {
+  cell addr = pop_int();
+#ifndef MEM_GUARD
+  if ((addr < 0 || addr >= MEMSIZE) && !mapped(addr, 1, false)) {
+    throw_err(ERR_ADDRESS);
+  }
+#endif
+  push_float(((fcell_alias *)membank)[addr]);
+}
+
+static void float_write(Xt *self) {
+  cell addr = pop_int();
+  fcell data = pop_float();
+#ifndef MEM_GUARD
+  if ((addr < 0 || addr >= MEMSIZE) && !mapped(addr, 1, true)) {
+    throw_err(ERR_ADDRESS);
+  }
+#endif
+  ((fcell_alias *)membank)[addr] = data;
+}
+
+// bulk float words work on n consecutive membank cells, the loops are plain
+// enough for the compiler to vectorise
+static void check_range(cell addr, cell n, bool write) {
+  if ((n < 0 || addr < 0 || addr > MEMSIZE - n) && !mapped(addr, n, write)) {
+    throw_err(ERR_ADDRESS);
+  }
+}
+
+static void pop_range3(cell *a, cell *b, cell *dst, cell *n) {
+  *n = pop_int();
+  *dst = pop_int();
+  *b = pop_int();
+  *a = pop_int();
+  check_range(*a, *n, false);
+  check_range(*b, *n, false);
+  check_range(*dst, *n, true);
+}
+
+static void fvadd_int(fcell_alias *dst, const fcell_alias *a,
+                      const fcell_alias *b, cell n) {
+  for (cell i = 0; i < n; i++) {
+    dst[i] = a[i] + b[i];
+  }
+}
+
+static void fvmul_int(fcell_alias *dst, const fcell_alias *a,
+                      const fcell_alias *b, cell n) {
+  for (cell i = 0; i < n; i++) {
+    dst[i] = a[i] * b[i];
+  }
+}
+
+// ( a b dst n -- )
+static void fvadd(Xt *self) {
+  cell a, b, dst, n;
+  pop_range3(&a, &b, &dst, &n);
+  fcell_alias *m = (fcell_alias *)membank;
+  fvadd_int(&m[dst], &m[a], &m[b], n);
+}
+
+// ( a b dst n -- )
+static void fvmul(Xt *self) {
+  cell a, b, dst, n;
+  pop_range3(&a, &b, &dst, &n);
+  fcell_alias *m = (fcell_alias *)membank;
+  fvmul_int(&m[dst], &m[a], &m[b], n);
+}
+
+// ( src dst n -- ) ( F: k -- ) dst[i] = src[i] * k
+static void fvscale(Xt *self) {
+  cell n = pop_int();
+  cell dst = pop_int();
+  cell src = pop_int();
+  fcell k = pop_float();
+  check_range(src, n, false);
+  check_range(dst, n, true);
+  fcell_alias *m = (fcell_alias *)membank;
+  for (cell i = 0; i < n; i++) {
+    m[dst + i] = m[src + i] * k;
+  }
+}
+
+// ( addr n -- ) ( F: -- sum )
+static void fvsum(Xt *self) {
+  cell n = pop_int();
+  cell addr = pop_int();
+  check_range(addr, n, false);
+  const fcell_alias *m = (fcell_alias *)membank + addr;
+  fcell sum = 0;
+  for (cell i = 0; i < n; i++) {
+    sum += m[i];
+  }
+  push_float(sum);
+}
+
+// fixed point: Q15 and Q31 fractions in cells, saturating instead of wrapping
+static int64_t saturate(int64_t v, int64_t lo, int64_t hi) {
+  return v < lo ? lo : v > hi ? hi : v;
+}
+
+#define FIXED_OP2(_name, _expr, _lo, _hi)                                      \
+  static void _name(Xt *self) {                                \
+    int64_t b = pop_int();                                                     \
+    int64_t a = pop_int();                                                     \
+    push_int(saturate(_expr, _lo, _hi));                                       \
+  }
+
+FIXED_OP2(q15add, a + b, INT16_MIN, INT16_MAX)
+FIXED_OP2(q15sub, a - b, INT16_MIN, INT16_MAX)
+FIXED_OP2(q15mul, (a * b + (1 << 14)) >> 15, INT16_MIN, INT16_MAX)
+FIXED_OP2(q31add, a + b, INT32_MIN, INT32_MAX)
+FIXED_OP2(q31sub, a - b, INT32_MIN, INT32_MAX)
+FIXED_OP2(q31mul, (a * b + (1ll << 30)) >> 31, INT32_MIN, INT32_MAX)
+
+static void float_to_q15(Xt *self) {
+  fcell a = pop_float();
+  push_int(saturate(lrint(a * 32768), INT16_MIN, INT16_MAX));
+}
+
+static void q15_to_float(Xt *self) {
+  cell a = pop_int();
+  push_float((fcell)a / 32768);
+}
+
+static cell frame_base(cell at);
+
+// Backward branches and calls made by running code count fuel_tick down,
+// and refuel takes the next slice of the budget when it runs out
+static _Thread_local int64_t fuel_tick = 0;
+static void refuel(void);
+
+// primitives run and colon definitions entered on this thread, pool
+// threads add theirs to pool_counts after every job
+typedef struct {
+  uint64_t dispatches, calls;
+} Counts;
+
+static _Thread_local Counts counts;
+static struct {
+  _Atomic uint64_t dispatches, calls;
+} pool_counts;
+static _Thread_local bool pool_worker = false;
+
+static inline void charge(void) {
+  if (--fuel_tick < 0) {
+    refuel();
   }
+}
+
+// jmp and jmpz take a position counted from the start of the definition
+static void jmp(Xt *self) {
+  charge();
+  cell pos = pop_int();
+  if (pos < 0) {
+    throw_err(ERR_ARG);
+  }
+  ip_d = frame_base(ip_d) + pos - 1;
+}
+
+static void jmpz(Xt *self) {
+  charge();
+  cell condition = pop_int();
+  cell pos = pop_int();
 
   if (pos < 0) {
-    return -5;
+    throw_err(ERR_ARG);
   }
-  popr_int(&err);
   if (condition == 0) {
-    if (err != 1) {
-      return err;
+    ip_d = frame_base(ip_d) + pos - 1;
+  }
+}
+
+// compiled branches carry their offset inline, like lit carries its value,
+// and move ip to one before the target since the inner interpreter steps
+// past it afterwards. Fuel is charged before anything moves, so a run
+// stopped there can start again at the same branch.
+static void branch(Xt *self) {
+  if (code[ip_d + 1] < 0) {
+    charge();
+  }
+  ip_d += code[ip_d + 1];
+}
+
+static void zbranch(Xt *self) {
+  if (code[ip_d + 1] < 0) {
+    charge();
+  }
+  cell flag = pop_int();
+  ip_d += flag == 0 ? code[ip_d + 1] : 1;
+}
+
+static void pushloop(Xt *self) {
+  cell start = pop_int();
+  cell limit = pop_int();
+  if (ls->sp >= ls->max - 1) {
+    throw_err(ERR_LOOP_DEPTH);
+  }
+  ls->data[++ls->sp] = limit;
+  ls->data[++ls->sp] = start;
+}
+
+static void doloop(Xt *self) {
+  charge();
+  if (++ls->data[ls->sp] != ls->data[ls->sp - 1]) {
+    ip_d += code[ip_d + 1];
+  } else {
+    ls->sp -= 2;
+    ip_d++;
+  }
+}
+
+// leaves the loop when the index crosses the boundary between limit-1 and
+// limit, in either direction
+static void doplusloop(Xt *self) {
+  charge();
+  cell n = pop_int();
+  ucell from = ls->data[ls->sp] - ls->data[ls->sp - 1];
+  ucell to = from + n;
+  ls->data[ls->sp] += n;
+  if (((cell)(from ^ to) >= 0) || ((cell)(from ^ n) >= 0)) {
+    ip_d += code[ip_d + 1];
+  } else {
+    ls->sp -= 2;
+    ip_d++;
+  }
+}
+
+static void loop_i(Xt *self) {
+  if (ls->sp < 1) {
+    throw_err(ERR_STACK_UNDERFLOW);
+  }
+  push_int(ls->data[ls->sp]);
+}
+
+static void loop_j(Xt *self) {
+  if (ls->sp < 3) {
+    throw_err(ERR_STACK_UNDERFLOW);
+  }
+  push_int(ls->data[ls->sp - 2]);
+}
+
+static void unloop(Xt *self) {
+  if (ls->sp < 1) {
+    throw_err(ERR_STACK_UNDERFLOW);
+  }
+  ls->sp -= 2;
+}
+
+// Colon definitions nest on the return stack rather than the C stack: enter
+// saves ip and points it at the body, exit restores it, and run keeps
+// stepping until the frame it started with is gone. A negative cell is a
+// tail call to ~cell, compiled for a call that ends a definition: the callee
+// takes over this frame instead of nesting. Only calls compiled into code
+// are charged: one a primitive makes through run comes back to C.
+static void enter(Xt *self) {
+  if (--fuel_tick < 0 && ip_d >= 0 && xts + code[ip_d] == self) {
+    refuel();
+  }
+  counts.calls++;
+  pushr_int(ip_d);
+  ip_d = self->body - 1;
+}
+
+static void exit_word(Xt *self) { ip_d = popr_int(); }
+
+// steps through code after ip_d until the frame above depth returns
+static void step(int depth) {
+  run_nest++;
+  for (;;) {
+    cell xt = code[++ip_d];
+    counts.dispatches++;
+    if (xt > EXIT_XT) {
+      xts[xt].fn(&xts[xt]);
+    } else if (xt == EXIT_XT) {
+      ip_d = popr_int();
+      if (rs->sp <= depth) {
+        run_nest--;
+        return;
+      }
+    } else if (xt == 0) {
+      push_int(code[++ip_d]); // lit
+    } else if (xts[~xt].fn != enter) {
+      xts[~xt].fn(&xts[~xt]); // made pure since, the exit after it returns
+    } else {
+      charge();
+      counts.calls++;
+      ip_d = xts[~xt].body - 1;
     }
-    pushr_int(pos - 1);
   }
+}
 
-  return 1;
+static void run(Xt *x) {
+  int depth = rs->sp;
+  counts.dispatches++;
+  x->fn(x);
+  if (rs->sp <= depth) {
+    return; // a primitive
+  }
+  step(depth);
 }
 
-int enter(Word *word, Word *caller) {
-  ip_d = 0;
-  int err = 1;
-  while (ip_d < word->def_len) {
-    Word *entering_word = &dict[word->def[ip_d]];
-    err = pushr_int(ip_d);
-    if (err != 1) {
-      return err;
+// A pure word's results depend only on the cells it takes, so calls to it go
+// through memo_enter, which looks the inputs up in a cache before running
+// the body. Every thread has its own cache, MEMO_WAYS entries to a set and
+// the least recently used one in a set replaced. Bumping memo_gen empties
+// all of them at once.
+typedef struct {
+  cell xt;
+  unsigned gen;
+  uint32_t used; // memo.clock at the last use
+  cell in[MEMO_IN], out[MEMO_OUT];
+} MemoEntry;
+
+static unsigned memo_gen = 1;
+static _Thread_local struct {
+  MemoEntry *sets; // MEMO_SETS * MEMO_WAYS, allocated on first use
+  uint32_t clock;
+  uint64_t hits, misses;
+} memo;
+
+static void memo_enter(Xt *self) {
+  cell xt = self - xts;
+  int in = dict[xt].pure_in, out = dict[xt].pure_out;
+  if (ds->sp + 1 < in) {
+    throw_err(ERR_STACK_UNDERFLOW);
+  }
+  if (!memo.sets &&
+      !(memo.sets = calloc(MEMO_SETS * MEMO_WAYS, sizeof(MemoEntry)))) {
+    run(&(Xt){enter, self->body});
+    return;
+  }
+  const cell *args = &ds->data[ds->sp + 1 - in];
+  uint64_t h = (uint64_t)xt * 0x9e3779b97f4a7c15u;
+  for (int i = 0; i < in; i++) {
+    h = (h ^ (ucell)args[i]) * 0xff51afd7ed558ccdu;
+    h ^= h >> 32;
+  }
+  MemoEntry *set = &memo.sets[(h & (MEMO_SETS - 1)) * MEMO_WAYS];
+  MemoEntry *victim = set;
+  for (MemoEntry *e = set; e < set + MEMO_WAYS; e++) {
+    if (e->xt == xt && e->gen == memo_gen &&
+        !memcmp(e->in, args, in * sizeof(cell))) {
+      ds->sp -= in;
+      for (int i = 0; i < out; i++) {
+        push_int(e->out[i]);
+      }
+      e->used = ++memo.clock;
+      memo.hits++;
+      return;
     }
-    entering_word->enter(entering_word, word);
-    ip_d = popr_int(&err);
-    if (err != 1) {
-      return err;
+    if (e->used < victim->used) {
+      victim = e;
     }
-    ip_d++;
   }
-  return 1;
+  memo.misses++;
+  cell key[MEMO_IN];
+  memcpy(key, args, in * sizeof(cell));
+  int sp = ds->sp;
+  run(&(Xt){enter, self->body});
+  if (ds->sp != sp - in + out) {
+    return; // doesn't match what pure declared, so not worth keeping
+  }
+  victim->xt = xt;
+  victim->gen = memo_gen;
+  victim->used = ++memo.clock;
+  memcpy(victim->in, key, in * sizeof(cell));
+  memcpy(victim->out, &ds->data[ds->sp + 1 - out], out * sizeof(cell));
 }
 
-cell write(Word *self, Word *caller) {
-  cell err = 1;
-  cell addr = pop_int(&err);
-  if (err != 1) {
-    return err;
+// ( in out -- ) marks the newest definition pure, taking in cells and
+// leaving out
+static void pure(Xt *self) {
+  cell out = pop_int();
+  cell in = pop_int();
+  if (top_word < 0 || xts[top_word].fn != enter || in < 0 || in > MEMO_IN ||
+      out < 0 || out > MEMO_OUT) {
+    throw_err(ERR_ARG);
   }
-  cell data = pop_int(&err);
-  if (err != 1) {
-    return err;
+  dict[top_word].pure_in = in;
+  dict[top_word].pure_out = out;
+  xts[top_word].fn = memo_enter;
+  memo_gen++;
+}
+
+static void memo_clear(Xt *self) { memo_gen++; }
+
+// ( -- hits misses ) for this thread's cache
+static void memo_stats(Xt *self) {
+  push_int(memo.hits);
+  push_int(memo.misses);
+}
+
+static void store(Xt *self) {
+  cell addr = pop_int();
+  cell data = pop_int();
+#ifndef MEM_GUARD
+  if ((addr < 0 || addr >= MEMSIZE) && !mapped(addr, 1, true)) {
+    throw_err(ERR_ADDRESS);
   }
-  if (addr < MEMSIZE) {
-    membank[addr] = data;
-  } else {
-    return -6;
+#endif
+  membank[addr] = data;
+}
+
+static void fetch(Xt *self) {
+  cell addr = pop_int();
+#ifndef MEM_GUARD
+  if ((addr < 0 || addr >= MEMSIZE) && !mapped(addr, 1, false)) {
+    throw_err(ERR_ADDRESS);
+  }
+#endif
+  push_int(membank[addr]);
+}
+
+static void negate(Xt *self) {
+  cell cond = pop_int();
+  push_int(cond == 0);
+}
+
+// latency histograms: buckets are linear within every power of two, so the
+// relative error of a percentile stays below 2^-HIST_SUB at any magnitude.
+// One thread records, any thread may read or reset.
+#define HIST_N ((64 - HIST_SUB + 1) << HIST_SUB)
+
+typedef struct {
+  _Atomic uint64_t counts[HIST_N];
+  _Atomic uint64_t n;
+  _Atomic uint64_t sum;
+  _Atomic uint64_t max;
+  _Atomic uint64_t misses; // samples over the deadline
+} Hist;
+
+static Hist render_hist; // time to render one block
+static Hist dispatch_hist; // time from a block's commit to its write
+
+static uint64_t now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static int hist_bucket(uint64_t v) {
+  if (v < (1u << HIST_SUB)) {
+    return v;
+  }
+  int shift = 63 - __builtin_clzll(v) - HIST_SUB;
+  return ((shift + 1) << HIST_SUB) + ((v >> shift) & ((1u << HIST_SUB) - 1));
+}
+
+// largest value that falls into bucket b
+static uint64_t hist_value(int b) {
+  if (b < (1 << HIST_SUB)) {
+    return b;
+  }
+  int shift = (b >> HIST_SUB) - 1;
+  uint64_t low = ((uint64_t)(b & ((1u << HIST_SUB) - 1)) | (1u << HIST_SUB))
+                 << shift;
+  return low + ((uint64_t)1 << shift) - 1;
+}
+
+static void hist_record(Hist *h, uint64_t v, uint64_t deadline) {
+  atomic_fetch_add_explicit(&h->counts[hist_bucket(v)], 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->n, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum, v, memory_order_relaxed);
+  if (v > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+    atomic_store_explicit(&h->max, v, memory_order_relaxed);
+  }
+  if (deadline && v > deadline) {
+    atomic_fetch_add_explicit(&h->misses, 1, memory_order_relaxed);
+  }
+}
+
+// value below which a permille of the samples fall
+static uint64_t hist_percentile(Hist *h, uint64_t permille) {
+  uint64_t n = atomic_load_explicit(&h->n, memory_order_relaxed);
+  if (n == 0) {
+    return 0;
+  }
+  uint64_t rank = (n * permille + 999) / 1000, seen = 0;
+  for (int b = 0; b < HIST_N; b++) {
+    seen += atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+    if (seen >= rank) {
+      uint64_t v = hist_value(b);
+      uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+      return v < max ? v : max;
+    }
+  }
+  return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+static void hist_reset(Hist *h) {
+  for (int b = 0; b < HIST_N; b++) {
+    atomic_store_explicit(&h->counts[b], 0, memory_order_relaxed);
+  }
+  atomic_store_explicit(&h->n, 0, memory_order_relaxed);
+  atomic_store_explicit(&h->sum, 0, memory_order_relaxed);
+  atomic_store_explicit(&h->max, 0, memory_order_relaxed);
+  atomic_store_explicit(&h->misses, 0, memory_order_relaxed);
+}
+
+// MORTH_LATENCY is only read by the command line program
+#ifndef MORTH_LIBRARY
+static void hist_json(FILE *f, const char *name, Hist *h) {
+  uint64_t n = atomic_load_explicit(&h->n, memory_order_relaxed);
+  fprintf(f,
+          "\"%s\":{\"count\":%llu,\"mean_ns\":%llu,\"p50_ns\":%llu,"
+          "\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu,"
+          "\"misses\":%llu,\"buckets\":[",
+          name, (unsigned long long)n,
+          (unsigned long long)(n ? atomic_load(&h->sum) / n : 0),
+          (unsigned long long)hist_percentile(h, 500),
+          (unsigned long long)hist_percentile(h, 900),
+          (unsigned long long)hist_percentile(h, 990),
+          (unsigned long long)hist_percentile(h, 999),
+          (unsigned long long)atomic_load(&h->max),
+          (unsigned long long)atomic_load(&h->misses));
+  bool first = true;
+  for (int b = 0; b < HIST_N; b++) {
+    uint64_t c = atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+    if (c) {
+      fprintf(f, "%s[%llu,%llu]", first ? "" : ",",
+              (unsigned long long)hist_value(b), (unsigned long long)c);
+      first = false;
+    }
+  }
+  fputs("]}", f);
+}
+
+// written at exit to the file named by MORTH_LATENCY
+static void latency_dump() {
+  const char *path = getenv("MORTH_LATENCY");
+  FILE *f = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+  if (!f) {
+    return;
+  }
+  fputc('{', f);
+  hist_json(f, "render", &render_hist);
+  fputc(',', f);
+  hist_json(f, "dispatch", &dispatch_hist);
+  fputs("}\n", f);
+  if (f != stderr) {
+    fclose(f);
+  }
+}
+#endif
+
+static void lat_p50(Xt *self) {
+  push_int(hist_percentile(&render_hist, 500) / 1000);
+}
+
+static void lat_p99(Xt *self) {
+  push_int(hist_percentile(&render_hist, 990) / 1000);
+}
+
+static void lat_max(Xt *self) {
+  push_int(atomic_load(&render_hist.max) / 1000);
+}
+
+static void lat_reset(Xt *self) {
+  hist_reset(&render_hist);
+  hist_reset(&dispatch_hist);
+}
+
+// audio output: the interpreter produces blocks into a single-producer
+// single-consumer ring, a writer thread drains it into the sink.
+// head is only written by the producer, tail only by the writer.
+static struct {
+  int16_t blocks[RING_N][BLOCK_N];
+  uint64_t queued[RING_N]; // time each block was committed, in ns
+  _Alignas(64) _Atomic uint64_t head;
+  _Alignas(64) _Atomic uint64_t tail;
+  _Alignas(64) cell fill; // samples in the block being produced
+  bool full;             // producer is waiting on a full ring
+  bool open;
+  _Atomic bool running;
+  cell rate; // samples per second, 0 writes as fast as the sink takes it
+  FILE *sink;
+  pthread_t writer;
+  _Atomic cell xruns;
+  _Atomic cell underruns;
+} stream;
+
+// writes n blocks starting at tail, split in at most two fwrites
+static void stream_drain(uint64_t tail, uint64_t n) {
+  while (n > 0) {
+    uint64_t at = tail & (RING_N - 1);
+    uint64_t run = RING_N - at < n ? RING_N - at : n;
+    fwrite(stream.blocks[at], sizeof(stream.blocks[0]), run, stream.sink);
+    uint64_t t = now_ns();
+    for (uint64_t i = at; i < at + run; i++) {
+      hist_record(&dispatch_hist, t - stream.queued[i], 0);
+    }
+    tail += run;
+    n -= run;
+    atomic_store_explicit(&stream.tail, tail, memory_order_release);
+  }
+}
+
+static void *stream_writer(void *arg) {
+  uint64_t period = 0;
+  if (stream.rate > 0)
+    period = (uint64_t)BLOCK_N * 1000000000 / stream.rate;
+  uint64_t deadline = now_ns() + period;
+  while (1) {
+    uint64_t tail = atomic_load_explicit(&stream.tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&stream.head, memory_order_acquire);
+    bool running = atomic_load_explicit(&stream.running, memory_order_acquire);
+    if (head == tail) {
+      if (!running) {
+        // the producer may have committed its last block after we loaded head
+        if (atomic_load_explicit(&stream.head, memory_order_acquire) == tail)
+          break;
+        continue;
+      }
+      if (period) {
+        atomic_fetch_add_explicit(&stream.underruns, 1, memory_order_relaxed);
+        deadline += period;
+      } else {
+        fflush(stream.sink);
+        deadline = now_ns() + BLOCK_N * 1000;
+      }
+    } else if (period && running) {
+      // a paced sink takes one block per period, more if we woke up late
+      uint64_t t = now_ns();
+      uint64_t due = 1 + (t > deadline ? (t - deadline) / period : 0);
+      stream_drain(tail, head - tail < due ? head - tail : due);
+      deadline += due * period;
+      continue;
+    } else {
+      stream_drain(tail, head - tail);
+      continue;
+    }
+    struct timespec ts = {.tv_sec = deadline / 1000000000,
+                          .tv_nsec = deadline % 1000000000};
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+  }
+  fflush(stream.sink);
+  return NULL;
+}
+
+static void stream_commit() {
+  uint64_t head = atomic_load_explicit(&stream.head, memory_order_relaxed);
+  stream.queued[head & (RING_N - 1)] = now_ns();
+  atomic_store_explicit(&stream.head, head + 1, memory_order_release);
+  stream.fill = 0;
+}
+
+static void stream_close() {
+  if (!stream.open) {
+    return;
+  }
+  if (stream.fill > 0) {
+    uint64_t head = atomic_load_explicit(&stream.head, memory_order_relaxed);
+    memset(&stream.blocks[head & (RING_N - 1)][stream.fill], 0,
+           (BLOCK_N - stream.fill) * sizeof(int16_t));
+    stream_commit();
+  }
+  atomic_store_explicit(&stream.running, false, memory_order_release);
+  pthread_join(stream.writer, NULL);
+  if (stream.sink != stdout) {
+    fclose(stream.sink);
+  }
+  stream.open = false;
+}
+
+static void stream_open(Xt *self) {
+  const char *at;
+  size_t n = parse_name(&at);
+  char path[256];
+  if (n == 0) {
+    throw_err(ERR_NO_NAME);
+  }
+  if (n >= sizeof(path)) {
+    throw_err(ERR_NAME_LONG);
+  }
+  memcpy(path, at, n);
+  path[n] = '\0';
+  if (stream.open) {
+    stream_close();
+  }
+  out_flush();
+  FILE *sink = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+  if (!sink) {
+    throw_err(ERR_IO);
+  }
+  stream.sink = sink;
+  stream.fill = 0;
+  atomic_store(&stream.head, 0);
+  atomic_store(&stream.tail, 0);
+  atomic_store(&stream.running, true);
+  if (pthread_create(&stream.writer, NULL, stream_writer, NULL) != 0) {
+    if (sink != stdout)
+      fclose(sink);
+    throw_err(ERR_IO);
+  }
+  static bool registered = false;
+  if (!registered) {
+    atexit(stream_close);
+    registered = true;
+  }
+  stream.open = true;
+}
+
+static void stream_end(Xt *self) {
+  stream_close();
+}
+
+static void stream_rate(Xt *self) {
+  cell rate = pop_int();
+  if (rate < 0) {
+    throw_err(ERR_ARG);
+  }
+  stream.rate = rate;
+}
+
+// queues one sample, waiting for the writer when the ring is full
+static void stream_put(cell sample) {
+  if (!stream.open) {
+    throw_err(ERR_IO);
+  }
+  uint64_t head = atomic_load_explicit(&stream.head, memory_order_relaxed);
+  if (stream.fill == 0) {
+    while (head - atomic_load_explicit(&stream.tail, memory_order_acquire) >=
+           RING_N) {
+      if (!stream.full) {
+        atomic_fetch_add_explicit(&stream.xruns, 1, memory_order_relaxed);
+        stream.full = true;
+      }
+      sched_yield();
+    }
+    stream.full = false;
+  }
+  if (sample > INT16_MAX)
+    sample = INT16_MAX;
+  if (sample < INT16_MIN)
+    sample = INT16_MIN;
+  stream.blocks[head & (RING_N - 1)][stream.fill++] = sample;
+  if (stream.fill == BLOCK_N) {
+    stream_commit();
+  }
+}
+
+static void out(Xt *self) {
+  cell sample = pop_int();
+  stream_put(sample);
+}
+
+static void xruns(Xt *self) {
+  push_int(atomic_load_explicit(&stream.xruns, memory_order_relaxed));
+}
+
+static void underruns(Xt *self) {
+  push_int(atomic_load_explicit(&stream.underruns, memory_order_relaxed));
+}
+
+// average and worst time from block commit to write, in microseconds
+static void blk_lat(Xt *self) {
+  uint64_t n = atomic_load(&dispatch_hist.n);
+  push_int(n ? atomic_load(&dispatch_hist.sum) / n / 1000 : 0);
+}
+
+static void blk_lat_max(Xt *self) {
+  push_int(atomic_load(&dispatch_hist.max) / 1000);
+}
+
+// polyphony: every voice runs its render word once per sample into its own
+// block, the render threads split the voices between them and the
+// interpreter mixes the blocks down once all of them reached the barrier.
+typedef struct {
+  cell xt; // render word ( -- sample ), -1 for a free voice
+  cell err; // last code thrown while rendering, 0 if none
+  uint64_t cpu_ns;
+  _Alignas(64) cell buf[BLOCK_N];
+} Voice;
+
+static struct {
+  Voice voices[VOICE_N];
+  _Alignas(64) cell mix[BLOCK_N];
+  cell top; // every voice in use is below top
+  _Atomic cell next;
+  void (*job)(void); // what every thread runs between the barriers
+  bool started, busy;
+  pthread_barrier_t start;
+  pthread_barrier_t done;
+  pthread_t threads[THREAD_N - 1];
+  Stack ds, rs; // the interpreter's own while it renders its share
+} pool;
+
+static _Thread_local cell current_voice = -1;
+// threads the pool runs on, MORTH_THREADS can lower it to time scaling
+static int pool_n = THREAD_N;
+
+static uint64_t cpu_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void render_block(cell v) {
+  Voice *voice = &pool.voices[v];
+  Xt *x = &xts[voice->xt];
+  for (int i = 0; i < BLOCK_N; i++) {
+    run(x);
+    voice->buf[i] = pop_int();
+  }
+}
+
+// a voice that throws is silent for the rest of the block
+static void render_voice(cell v) {
+  Voice *voice = &pool.voices[v];
+  uint64_t t = cpu_ns();
+  current_voice = v;
+  ds->sp = -1;
+  rs->sp = -1;
+  cell code = guarded(render_block, v);
+  if (code) {
+    voice->err = code;
+    memset(voice->buf, 0, sizeof(voice->buf));
+  }
+  current_voice = -1;
+  voice->cpu_ns += cpu_ns() - t;
+}
+
+static void render_voices() {
+  cell v;
+  while ((v = atomic_fetch_add_explicit(&pool.next, 1,
+                                        memory_order_relaxed)) < pool.top) {
+    if (pool.voices[v].xt >= 0) {
+      render_voice(v);
+    }
+  }
+}
+
+static void *pool_thread(void *arg) {
+  pool_worker = true;
+  Stack own_ds, own_rs, own_ls;
+  FStack own_fs;
+  stack_init(&own_ds);
+  stack_init(&own_rs);
+  stack_init(&own_ls);
+  fstack_init(&own_fs);
+  ds = &own_ds;
+  rs = &own_rs;
+  ls = &own_ls;
+  fs = &own_fs;
+  while (1) {
+    pthread_barrier_wait(&pool.start);
+    pool.job();
+    out_flush();
+    pool_counts.dispatches += counts.dispatches;
+    pool_counts.calls += counts.calls;
+    counts = (Counts){0};
+    pthread_barrier_wait(&pool.done);
+  }
+  return NULL;
+}
+
+static void mixdown(cell *restrict mix, const cell *restrict buf) {
+  for (int i = 0; i < BLOCK_N; i++) {
+    mix[i] += buf[i];
+  }
+}
+
+static void pool_start() {
+  const char *env = getenv("MORTH_THREADS");
+  if (env && atoi(env) >= 1 && atoi(env) < THREAD_N) {
+    pool_n = atoi(env);
+  }
+  stack_init(&pool.ds);
+  stack_init(&pool.rs);
+  pthread_barrier_init(&pool.start, NULL, pool_n);
+  pthread_barrier_init(&pool.done, NULL, pool_n);
+  for (int i = 0; i < pool_n - 1; i++) {
+    if (pthread_create(&pool.threads[i], NULL, pool_thread, NULL) != 0) {
+      throw_err(ERR_IO);
+    }
+    pthread_detach(pool.threads[i]);
+  }
+  pool.started = true;
+}
+
+// runs job on every pool thread and the interpreter, returns once all of
+// them are done. A job started from inside another one would never meet the
+// other threads at the barrier, so that is an error.
+static void pool_run(void (*job)(void)) {
+  if (pool.busy) {
+    throw_err(ERR_ARG);
+  }
+  if (!pool.started) {
+    pool_start();
+  }
+  Stack *saved_ds = ds, *saved_rs = rs;
+  ds = &pool.ds;
+  rs = &pool.rs;
+  pool.busy = true;
+  pool.job = job;
+  atomic_store_explicit(&pool.next, 0, memory_order_relaxed);
+  pthread_barrier_wait(&pool.start);
+  job();
+  pthread_barrier_wait(&pool.done);
+  pool.busy = false;
+  ds = saved_ds;
+  rs = saved_rs;
+}
+
+// renders one block of every voice and sends the mix to the stream
+static void render(Xt *self) {
+  uint64_t t = now_ns();
+  pool_run(render_voices);
+
+  memset(pool.mix, 0, sizeof(pool.mix));
+  for (cell v = 0; v < pool.top; v++) {
+    if (pool.voices[v].xt >= 0) {
+      mixdown(pool.mix, pool.voices[v].buf);
+    }
+  }
+  cell rate = stream.rate ? stream.rate : RATE;
+  hist_record(&render_hist, now_ns() - t,
+              (uint64_t)BLOCK_N * 1000000000 / rate);
+  if (stream.open) {
+    for (int i = 0; i < BLOCK_N; i++) {
+      stream_put(pool.mix[i]);
+    }
+  }
+}
+
+static void voice_add(Xt *self) {
+  cell xt = pop_int();
+  if (xt < 0 || xt > top_word) {
+    throw_err(ERR_ARG);
+  }
+  cell v = 0;
+  while (v < pool.top && pool.voices[v].xt >= 0) {
+    v++;
+  }
+  if (v == VOICE_N) {
+    throw_err(ERR_DICT_OVERFLOW);
+  }
+  if (v == pool.top) {
+    pool.top++;
+  }
+  pool.voices[v].xt = xt;
+  pool.voices[v].err = 0;
+  pool.voices[v].cpu_ns = 0;
+  push_int(v);
+}
+
+static void voice_del(Xt *self) {
+  cell v = pop_int();
+  if (v < 0 || v >= pool.top) {
+    throw_err(ERR_ARG);
+  }
+  pool.voices[v].xt = -1;
+  while (pool.top > 0 && pool.voices[pool.top - 1].xt < 0) {
+    pool.top--;
+  }
+}
+
+// the voice being rendered, so a patch can keep per-voice state
+static void voice_id(Xt *self) { push_int(current_voice); }
+
+// CPU time spent rendering a voice since it was added, in microseconds
+static void voice_cpu(Xt *self) {
+  cell v = pop_int();
+  if (v < 0 || v >= pool.top) {
+    throw_err(ERR_ARG);
+  }
+  push_int(pool.voices[v].cpu_ns / 1000);
+}
+
+static void mix_read(Xt *self) {
+  cell i = pop_int();
+  if (i < 0 || i >= BLOCK_N) {
+    throw_err(ERR_ADDRESS);
+  }
+  push_int(pool.mix[i]);
+}
+
+// pmap and preduce split a range into PAR_CHUNK aligned chunks that the pool
+// threads claim one at a time, each running the word on its own stacks.
+static struct {
+  cell addr, n, xt;
+  cell base, chunks; // chunk i starts at base + i * PAR_CHUNK, clipped to the range
+  _Atomic cell err;  // first code thrown, the other threads stop claiming
+  cell partial[(MEMSIZE + MAP_CELLS) / PAR_CHUNK + 2]; // mapped ranges too
+} par;
+
+static void par_bounds(cell i, cell *lo, cell *hi) {
+  *lo = par.base + i * PAR_CHUNK;
+  *hi = *lo + PAR_CHUNK;
+  if (*lo < par.addr) {
+    *lo = par.addr;
+  }
+  if (*hi > par.addr + par.n) {
+    *hi = par.addr + par.n;
+  }
+}
+
+static void map_chunk(cell i) {
+  cell lo, hi;
+  par_bounds(i, &lo, &hi);
+  Xt *x = &xts[par.xt];
+  for (cell a = lo; a < hi; a++) {
+    push_int(membank[a]);
+    run(x);
+    membank[a] = pop_int();
+  }
+}
+
+// a chunk starts from its first cell, init only comes in when the partials
+// are folded, so the result is a left fold for any associative word
+static void reduce_chunk(cell i) {
+  cell lo, hi;
+  par_bounds(i, &lo, &hi);
+  Xt *x = &xts[par.xt];
+  push_int(membank[lo]);
+  for (cell a = lo + 1; a < hi; a++) {
+    push_int(membank[a]);
+    run(x);
+  }
+  par.partial[i] = pop_int();
+}
+
+static void par_chunks(void (*chunk)(cell)) {
+  ds->sp = -1;
+  rs->sp = -1;
+  cell i;
+  while (!atomic_load_explicit(&par.err, memory_order_relaxed) &&
+         (i = atomic_fetch_add_explicit(&pool.next, 1, memory_order_relaxed)) <
+             par.chunks) {
+    cell code = guarded(chunk, i);
+    if (code) {
+      cell none = 0;
+      atomic_compare_exchange_strong(&par.err, &none, code);
+    }
+  }
+}
+
+static void par_map() { par_chunks(map_chunk); }
+
+static void par_reduce() { par_chunks(reduce_chunk); }
+
+static void par_start(cell addr, cell n, cell xt, void (*job)(void)) {
+  check_range(addr, n, job == par_map);
+  if (xt < 0 || xt > top_word) {
+    throw_err(ERR_ARG);
+  }
+  par.addr = addr;
+  par.n = n;
+  par.xt = xt;
+  par.base = addr / PAR_CHUNK * PAR_CHUNK;
+  par.chunks = n ? (addr + n - 1 - par.base) / PAR_CHUNK + 1 : 0;
+  atomic_store(&par.err, 0);
+  if (par.chunks) {
+    pool_run(job);
+  }
+  cell code = atomic_load(&par.err);
+  if (code) {
+    throw_err(code);
+  }
+}
+
+// ( addr n xt -- ) addr[i] = xt(addr[i])
+static void pmap(Xt *self) {
+  cell xt = pop_int();
+  cell n = pop_int();
+  cell addr = pop_int();
+  par_start(addr, n, xt, par_map);
+}
+
+// ( addr n xt init -- r ) init addr[0] xt addr[1] xt ...
+static void preduce(Xt *self) {
+  cell init = pop_int();
+  cell xt = pop_int();
+  cell n = pop_int();
+  cell addr = pop_int();
+  par_start(addr, n, xt, par_reduce);
+  Xt *x = &xts[xt];
+  push_int(init);
+  for (cell i = 0; i < par.chunks; i++) {
+    push_int(par.partial[i]);
+    run(x);
+  }
+}
+
+// sort orders cells by an LSD radix sort on bytes, with the sign bit
+// flipped so negative cells come first. Passes where every cell has the same
+// byte are skipped, so small values only pay for their low bytes.
+#define SORT_SMALL 32 // ranges shorter than this get an insertion sort
+
+static void insertion_sort(cell *a, cell n) {
+  for (cell i = 1; i < n; i++) {
+    cell x = a[i], j = i;
+    for (; j > 0 && a[j - 1] > x; j--) {
+      a[j] = a[j - 1];
+    }
+    a[j] = x;
+  }
+}
+
+static void radix_sort(cell *a, cell n) {
+  cell *tmp = malloc(n * sizeof(cell));
+  if (!tmp) {
+    throw_err(ERR_ALLOCATE);
+  }
+  cell count[sizeof(cell)][256] = {{0}}; // on the stack, pool threads sort too
+  const ucell flip = (ucell)1 << (CELL_BITS - 1);
+  for (cell i = 0; i < n; i++) {
+    ucell k = (ucell)a[i] ^ flip;
+    for (size_t b = 0; b < sizeof(cell); b++) {
+      count[b][k >> (8 * b) & 255]++;
+    }
+  }
+  cell *src = a, *dst = tmp;
+  for (size_t b = 0; b < sizeof(cell); b++) {
+    cell *c = count[b];
+    if (c[((ucell)a[0] ^ flip) >> (8 * b) & 255] == n) {
+      continue;
+    }
+    cell at = 0;
+    for (int d = 0; d < 256; d++) {
+      cell k = c[d];
+      c[d] = at;
+      at += k;
+    }
+    for (cell i = 0; i < n; i++) {
+      dst[c[((ucell)src[i] ^ flip) >> (8 * b) & 255]++] = src[i];
+    }
+    cell *t = src;
+    src = dst;
+    dst = t;
+  }
+  if (src != a) {
+    memcpy(a, src, n * sizeof(cell));
+  }
+  free(tmp);
+}
+
+// ( addr n -- )
+static void sort(Xt *self) {
+  cell n = pop_int();
+  cell addr = pop_int();
+  check_range(addr, n, true);
+  if (n < SORT_SMALL) {
+    insertion_sort(&membank[addr], n);
+  } else {
+    radix_sort(&membank[addr], n);
+  }
+}
+
+// sort-by orders by a word ( a b -- flag ), true when a goes before b. It is
+// an introsort: quicksort on a median of three, heapsort once the recursion
+// gets deeper than twice log2 n, insertion sort for short ranges.
+static bool before(Xt *cmp, cell a, cell b) {
+  push_int(a);
+  push_int(b);
+  run(cmp);
+  return pop_int() != 0;
+}
+
+static void swap_cells(cell *a, cell *b) {
+  cell t = *a;
+  *a = *b;
+  *b = t;
+}
+
+static void sift_down(Xt *cmp, cell *a, cell root, cell n) {
+  for (cell child; (child = 2 * root + 1) < n; root = child) {
+    if (child + 1 < n && before(cmp, a[child], a[child + 1])) {
+      child++;
+    }
+    if (!before(cmp, a[root], a[child])) {
+      return;
+    }
+    swap_cells(&a[root], &a[child]);
+  }
+}
+
+static void heap_sort(Xt *cmp, cell *a, cell n) {
+  for (cell i = n / 2 - 1; i >= 0; i--) {
+    sift_down(cmp, a, i, n);
+  }
+  for (cell i = n - 1; i > 0; i--) {
+    swap_cells(&a[0], &a[i]);
+    sift_down(cmp, a, 0, i);
+  }
+}
+
+static void intro_sort(Xt *cmp, cell *a, cell n, int depth) {
+  while (n >= SORT_SMALL) {
+    if (depth-- == 0) {
+      heap_sort(cmp, a, n);
+      return;
+    }
+    cell *m = &a[n / 2], *z = &a[n - 1];
+    if (before(cmp, *m, *a)) {
+      swap_cells(m, a);
+    }
+    if (before(cmp, *z, *m)) {
+      swap_cells(z, m);
+      if (before(cmp, *m, *a)) {
+        swap_cells(m, a);
+      }
+    }
+    cell pivot = *m;
+    cell i = 0, j = n - 1;
+    for (;;) {
+      // bounded, so a comparator that isn't a strict order can't run off
+      while (i < n - 1 && before(cmp, a[i], pivot)) {
+        i++;
+      }
+      while (j > 0 && before(cmp, pivot, a[j])) {
+        j--;
+      }
+      if (i >= j) {
+        break;
+      }
+      swap_cells(&a[i++], &a[j--]);
+    }
+    // recurse into the smaller side, loop on the larger
+    if (j + 1 < n - j - 1) {
+      intro_sort(cmp, a, j + 1, depth);
+      a += j + 1;
+      n -= j + 1;
+    } else {
+      intro_sort(cmp, a + j + 1, n - j - 1, depth);
+      n = j + 1;
+    }
+  }
+  for (cell i = 1; i < n; i++) {
+    cell x = a[i], j = i;
+    for (; j > 0 && before(cmp, x, a[j - 1]); j--) {
+      a[j] = a[j - 1];
+    }
+    a[j] = x;
+  }
+}
+
+// ( addr n xt -- )
+static void sort_by(Xt *self) {
+  cell xt = pop_int();
+  cell n = pop_int();
+  cell addr = pop_int();
+  check_range(addr, n, true);
+  if (xt < 0 || xt > top_word) {
+    throw_err(ERR_ARG);
+  }
+  int depth = 0;
+  for (cell k = n; k > 1; k >>= 1) {
+    depth += 2;
+  }
+  intro_sort(&xts[xt], &membank[addr], n, depth);
+}
+
+// ( addr n x -- i flag ) i is the first cell not below x in a sorted
+// range, flag whether it equals x
+static void bsearch_cells(Xt *self) {
+  cell x = pop_int();
+  cell n = pop_int();
+  cell addr = pop_int();
+  check_range(addr, n, false);
+  const cell *a = &membank[addr];
+  cell lo = 0, len = n;
+  while (n > 0) {
+    cell half = n / 2;
+    if (a[lo + half] < x) {
+      lo += half + 1;
+      n -= half + 1;
+    } else {
+      n = half;
+    }
+  }
+  push_int(lo);
+  push_int(lo < len && a[lo] == x);
+}
+
+// ( addr n -- n' ) drops every cell equal to the one before it, like uniq
+static void unique(Xt *self) {
+  cell n = pop_int();
+  cell addr = pop_int();
+  check_range(addr, n, true);
+  cell *a = &membank[addr];
+  cell k = n ? 1 : 0;
+  for (cell i = 1; i < n; i++) {
+    if (a[i] != a[k - 1]) {
+      a[k++] = a[i];
+    }
+  }
+  push_int(k);
+}
+
+// ( addr n -- h ) mixes every cell in with a multiply and a shift, the same
+// cells always give the same hash
+static void hash_range(Xt *self) {
+  cell n = pop_int();
+  cell addr = pop_int();
+  check_range(addr, n, false);
+  const cell *a = &membank[addr];
+  uint64_t h = 0x9e3779b97f4a7c15u ^ (uint64_t)n;
+  for (cell i = 0; i < n; i++) {
+    h = (h ^ (ucell)a[i]) * 0xff51afd7ed558ccdu;
+    h ^= h >> 32;
+  }
+  push_int((cell)h);
+}
+
+// A hash table is a heap block holding a header and, in another block, the
+// slots: three cells each, state, key and value. Open addressing with linear
+// probing; a deleted slot keeps a tombstone so later keys stay reachable,
+// and the slots are rebuilt twice as big once live and dead ones pass 3/4.
+enum { HT_MAGIC, HT_CAP, HT_COUNT, HT_USED, HT_SLOTS, HT_ITER, HT_HEADER };
+enum { SLOT_EMPTY, SLOT_FULL, SLOT_DEAD };
+#define HT_TAG ((cell)0x68746162) // "htab", catches a stray address
+
+static ucell ht_hash(cell key) {
+  uint64_t h = (ucell)key;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdu;
+  h ^= h >> 33;
+  return h;
+}
+
+static cell *ht_header(cell h) {
+  if (heap_cap(h) < HT_HEADER || membank[h + HT_MAGIC] != HT_TAG) {
+    throw_err(ERR_ARG);
+  }
+  return &membank[h];
+}
+
+// slot holding key, or the one to put it in, -1 if neither exists
+static cell ht_find(const cell *t, cell key, bool *found) {
+  cell mask = t[HT_CAP] - 1, dead = -1;
+  const cell *slots = &membank[t[HT_SLOTS]];
+  *found = false;
+  cell i = ht_hash(key) & mask;
+  for (cell n = 0; n <= mask; n++, i = (i + 1) & mask) {
+    const cell *s = &slots[3 * i];
+    if (s[0] == SLOT_EMPTY) {
+      return dead >= 0 ? dead : i;
+    }
+    if (s[0] == SLOT_FULL && s[1] == key) {
+      *found = true;
+      return i;
+    }
+    if (s[0] == SLOT_DEAD && dead < 0) {
+      dead = i;
+    }
+  }
+  return dead;
+}
+
+static cell ht_slots(cell cap) {
+  cell a = heap_alloc(3 * cap);
+  if (a < 0) {
+    throw_err(ERR_ALLOCATE);
+  }
+  for (cell i = 0; i < cap; i++) {
+    membank[a + 3 * i] = SLOT_EMPTY;
+  }
+  return a;
+}
+
+static void ht_grow(cell *t) {
+  cell old = t[HT_SLOTS], old_cap = t[HT_CAP];
+  cell cap = t[HT_COUNT] * 4 >= old_cap ? old_cap * 2 : old_cap;
+  t[HT_SLOTS] = ht_slots(cap); // same size when it's mostly tombstones
+  t[HT_CAP] = cap;
+  t[HT_USED] = t[HT_COUNT];
+  for (cell i = 0; i < old_cap; i++) {
+    const cell *s = &membank[old + 3 * i];
+    if (s[0] == SLOT_FULL) {
+      bool found;
+      cell *d = &membank[t[HT_SLOTS] + 3 * ht_find(t, s[1], &found)];
+      d[0] = SLOT_FULL;
+      d[1] = s[1];
+      d[2] = s[2];
+    }
+  }
+  heap_free(old);
+}
+
+// ( capacity -- h )
+static void htable(Xt *self) {
+  cell want = pop_int();
+  if (want < 0) {
+    throw_err(ERR_ARG);
+  }
+  cell cap = 8;
+  while (cap * 3 / 4 < want) {
+    cap *= 2;
+  }
+  cell slots = ht_slots(cap);
+  cell h = heap_alloc(HT_HEADER);
+  if (h < 0) {
+    heap_free(slots);
+    throw_err(ERR_ALLOCATE);
+  }
+  cell *t = &membank[h];
+  t[HT_MAGIC] = HT_TAG;
+  t[HT_CAP] = cap;
+  t[HT_COUNT] = t[HT_USED] = t[HT_ITER] = 0;
+  t[HT_SLOTS] = slots;
+  push_int(h);
+}
+
+// ( h -- )
+static void hfree(Xt *self) {
+  cell *t = ht_header(pop_int());
+  t[HT_MAGIC] = 0;
+  heap_free(t[HT_SLOTS]);
+  heap_free(t - membank);
+}
+
+// ( key h -- value flag ) value is 0 when the key is missing
+static void hfetch(Xt *self) {
+  cell *t = ht_header(pop_int());
+  cell key = pop_int();
+  bool found;
+  cell i = ht_find(t, key, &found);
+  push_int(found ? membank[t[HT_SLOTS] + 3 * i + 2] : 0);
+  push_int(found);
+}
+
+// ( value key h -- ) the slots don't move while hiter walks them
+static void hstore(Xt *self) {
+  cell *t = ht_header(pop_int());
+  cell key = pop_int();
+  cell value = pop_int();
+  bool found;
+  cell i = ht_find(t, key, &found);
+  if (!found && !t[HT_ITER] && (t[HT_USED] + 1) * 4 > t[HT_CAP] * 3) {
+    ht_grow(t);
+    i = ht_find(t, key, &found);
+  }
+  if (i < 0) {
+    throw_err(ERR_ALLOCATE);
+  }
+  cell *s = &membank[t[HT_SLOTS] + 3 * i];
+  if (!found) {
+    t[HT_COUNT]++;
+    t[HT_USED] += s[0] == SLOT_EMPTY;
+    s[0] = SLOT_FULL;
+    s[1] = key;
+  }
+  s[2] = value;
+}
+
+// ( key h -- flag ) whether the key was there
+static void hdel(Xt *self) {
+  cell *t = ht_header(pop_int());
+  cell key = pop_int();
+  bool found;
+  cell i = ht_find(t, key, &found);
+  if (found) {
+    membank[t[HT_SLOTS] + 3 * i] = SLOT_DEAD;
+    t[HT_COUNT]--;
+  }
+  push_int(found);
+}
+
+// ( h -- n )
+static void hcount(Xt *self) { push_int(ht_header(pop_int())[HT_COUNT]); }
+
+static _Thread_local cell walk_xt;
+
+static void ht_walk(cell h) {
+  cell xt = walk_xt;
+  const cell *t = &membank[h];
+  for (cell i = 0; i < t[HT_CAP]; i++) {
+    const cell *s = &membank[t[HT_SLOTS] + 3 * i];
+    if (s[0] == SLOT_FULL) {
+      push_int(s[1]);
+      push_int(s[2]);
+      run(&xts[xt]);
+    }
+  }
+}
+
+// ( h xt -- ) runs xt ( key value -- ) on every entry, in no set order
+static void hiter(Xt *self) {
+  cell xt = pop_int();
+  cell h = pop_int();
+  cell *t = ht_header(h);
+  if (xt < 0 || xt > top_word) {
+    throw_err(ERR_ARG);
+  }
+  walk_xt = xt;
+  t[HT_ITER]++;
+  cell code = guarded(ht_walk, h);
+  t[HT_ITER]--;
+  if (code) {
+    throw_err(code);
+  }
+}
+
+// Tasks are cooperative: each has its own small stacks and a saved ip, and
+// switching to one only swaps the stack pointers and ip. yield from the
+// interpreter runs one round, every ready task in turn until it yields,
+// pauses or returns. A task leaves its turn by throwing out of it; the catch
+// frame puts the interpreter's stacks back, the task's keep their depth.
+enum { TASK_FREE, TASK_READY, TASK_SLEEPING };
+
+typedef struct {
+  Stack ds, rs, ls;
+  FStack fs;
+  cell xt;
+  cell ip; // -1 until it first runs
+  int state;
+  bool switched; // left its turn through yield or pause, not by a throw
+#ifndef MORTH_GUARD
+  cell ds_mem[TASK_STACK], rs_mem[TASK_STACK], ls_mem[TASK_STACK / 2];
+  fcell fs_mem[TASK_STACK / 4];
+#endif
+} Task;
+
+static Task *tasks;
+static cell task_top = 0; // every task in use is below task_top
+static cell task_free[TASK_N];
+static cell task_free_n = 0;
+static Task *running = NULL;
+static Catch *running_frame; // yield and pause only work right inside it
+static int running_nest;
+
+static void task_stacks(Task *k) {
+#ifdef MORTH_GUARD
+  if (!k->ds.data) {
+    stack_init(&k->ds);
+    stack_init(&k->rs);
+    stack_init(&k->ls);
+    fstack_init(&k->fs);
+  }
+#else
+  k->ds = (Stack){k->ds_mem, -1, TASK_STACK - 1};
+  k->rs = (Stack){k->rs_mem, -1, TASK_STACK - 1};
+  k->ls = (Stack){k->ls_mem, -1, TASK_STACK / 2 - 1};
+  k->fs = (FStack){k->fs_mem, -1, TASK_STACK / 4 - 1};
+#endif
+  k->ds.sp = k->rs.sp = k->ls.sp = k->fs.sp = -1;
+}
+
+// ( xt -- t )
+static void task(Xt *self) {
+  cell xt = pop_int();
+  if (xt < 0 || xt > top_word) {
+    throw_err(ERR_ARG);
+  }
+  cell t;
+  if (task_free_n) {
+    t = task_free[--task_free_n];
+  } else if (task_top < TASK_N) {
+    t = task_top++;
+  } else {
+    throw_err(ERR_DICT_OVERFLOW);
+  }
+  Task *k = &tasks[t];
+  task_stacks(k);
+  k->xt = xt;
+  k->ip = -1;
+  k->state = TASK_READY;
+  push_int(t);
+}
+
+static void task_turn(cell t) {
+  Task *k = &tasks[t];
+  Stack *saved_ds = ds, *saved_rs = rs, *saved_ls = ls;
+  FStack *saved_fs = fs;
+  cell saved_ip = ip_d;
+  ds = &k->ds;
+  rs = &k->rs;
+  ls = &k->ls;
+  fs = &k->fs;
+  running = k;
+  running_frame = handler;
+  running_nest = run_nest + 1;
+  k->switched = false;
+  if (k->ip < 0) {
+    run(&xts[k->xt]);
+  } else if (k->rs.sp >= 0) {
+    ip_d = k->ip;
+    step(-1);
+  }
+  ds = saved_ds;
+  rs = saved_rs;
+  ls = saved_ls;
+  fs = saved_fs;
+  ip_d = saved_ip;
+}
+
+static void task_end(cell t) {
+  tasks[t].state = TASK_FREE;
+  if (t == task_top - 1) {
+    task_top--;
+  } else {
+    task_free[task_free_n++] = t;
+  }
+}
+
+// every ready task runs once, the first error one throws comes out after the
+// round and ends that task
+static void task_round() {
+  if (pool.busy) {
+    throw_err(ERR_ARG);
+  }
+  cell err = 0;
+  cell top = task_top;
+  for (cell t = 0; t < top; t++) {
+    if (tasks[t].state != TASK_READY) {
+      continue;
+    }
+    cell code = guarded(task_turn, t);
+    running = NULL;
+    if (code && tasks[t].switched) {
+      continue;
+    }
+    if (code && !err) {
+      err = code;
+    }
+    task_end(t);
+  }
+  if (err) {
+    throw_err(err);
+  }
+}
+
+static void task_switch(int state) {
+  if (!running || handler != running_frame || run_nest != running_nest) {
+    throw_err(ERR_ARG); // not in a task, or under catch or a nested run
+  }
+  running->ip = ip_d;
+  running->state = state;
+  running->switched = true;
+  throw_err(1);
+}
+
+static void yield(Xt *self) {
+  if (running) {
+    task_switch(TASK_READY);
+  }
+  task_round();
+}
+
+static void pause_task(Xt *self) { task_switch(TASK_SLEEPING); }
+
+// the task running, -1 in the interpreter
+static void task_id(Xt *self) { push_int(running ? running - tasks : -1); }
+
+// ( t -- )
+static void wake(Xt *self) {
+  cell t = pop_int();
+  if (t < 0 || t >= task_top || tasks[t].state == TASK_FREE) {
+    throw_err(ERR_ARG);
+  }
+  tasks[t].state = TASK_READY;
+}
+
+// A host bounds untrusted code with a budget of checks, one per backward
+// branch or call, and a deadline looked at once per slice of FUEL_SLICE.
+// When either runs out right in the outermost step loop the run is
+// suspended: its ip and stack depths go to susp and the throw unwinds to
+// the host, which picks it up with morth_resume. A task is made to yield
+// instead, and anywhere else, under catch or inside a primitive, the code
+// is thrown like any other error.
+static _Atomic int64_t fuel = INT64_MAX;
+static _Atomic uint64_t deadline = 0; // now_ns() to stop at, 0 for none
+
+typedef struct {
+  bool active; // a run is waiting for morth_resume
+  cell ip;
+  int ds_sp, rs_sp, ls_sp, fs_sp;
+  cell slot; // line cache slot the run is in, or -1
+  char *input; // what was left of the line being interpreted
+  size_t len;
+} Suspended;
+
+static Suspended susp = {.slot = -1};
+
+static void stats_due(void);
+
+static void refuel(void) {
+  stats_due();
+  uint64_t stop = atomic_load(&deadline);
+  cell err = MORTH_DEADLINE;
+  if (!stop || now_ns() < stop) {
+    int64_t left = atomic_load(&fuel);
+    int64_t take = left < FUEL_SLICE ? left : FUEL_SLICE;
+    if (take > 0) {
+      atomic_fetch_sub(&fuel, take);
+      fuel_tick = take - 1; // this check is the first of the slice
+      return;
+    }
+    err = MORTH_FUEL;
+  }
+  fuel_tick = 0; // the next check comes back here
+  ip_d--;        // and so does this one, once resumed
+  if (running && handler == running_frame && run_nest == running_nest) {
+    task_switch(TASK_READY);
+  }
+  if (rs == &main_rs && handler && !handler->prev &&
+      run_nest == handler->nest + 1) {
+    susp.active = true;
+    susp.ip = ip_d;
+    susp.ds_sp = ds->sp;
+    susp.rs_sp = rs->sp;
+    susp.ls_sp = ls->sp;
+    susp.fs_sp = fs->sp;
+  }
+  throw_err(err);
+}
+
+// What a script has used so far against the limits it was built with.
+// Dispatches and calls are only counted, the stacks' depth comes from their
+// paint and everything else is read off the VM when asked for.
+static void stats_read(MorthStats *st) {
+  *st = (MorthStats){
+      .dispatches = counts.dispatches + pool_counts.dispatches,
+      .calls = counts.calls + pool_counts.calls,
+      .ds_high = stack_high(&main_ds),
+      .rs_high = stack_high(&main_rs),
+      .stack_limit = STACKSIZE,
+      .words = top_word + 1,
+      .word_limit = WORD_N,
+      .code = code_top,
+      .code_limit = CODE_N,
+      .memtop = memtop,
+      .mem_limit = MEMSIZE,
+      .heap_used = heap.used,
+      .allocs = heap.allocs,
+      .frees = heap.frees,
+  };
+}
+
+static int stats_json(char *buf, size_t n) {
+  MorthStats st;
+  stats_read(&st);
+  return snprintf(
+      buf, n,
+      "{\"t\":%.3f,\"dispatches\":%llu,\"calls\":%llu,\"ds_high\":%lld,"
+      "\"rs_high\":%lld,\"stack_limit\":%lld,\"words\":%lld,"
+      "\"word_limit\":%lld,\"code\":%lld,\"code_limit\":%lld,"
+      "\"memtop\":%lld,\"mem_limit\":%lld,\"heap_used\":%lld,"
+      "\"allocs\":%llu,\"frees\":%llu}\n",
+      now_ns() / 1e9, (unsigned long long)st.dispatches,
+      (unsigned long long)st.calls, (long long)st.ds_high,
+      (long long)st.rs_high, (long long)st.stack_limit, (long long)st.words,
+      (long long)st.word_limit, (long long)st.code, (long long)st.code_limit,
+      (long long)st.memtop, (long long)st.mem_limit, (long long)st.heap_used,
+      (unsigned long long)st.allocs, (unsigned long long)st.frees);
+}
+
+// prints the stats as one line of JSON
+static void stats(Xt *self) {
+  char buf[512];
+  out_write(buf, stats_json(buf, sizeof(buf)));
+}
+
+// With a stats fd set, the interpreter's thread writes a line there once a
+// period has passed, looked at when it takes a slice of fuel and after
+// every line of input
+static int stats_fd = -1;
+static uint64_t stats_period, stats_next;
+
+static void stats_due(void) {
+  if (stats_fd < 0 || pool_worker) {
+    return;
+  }
+  uint64_t t = now_ns();
+  if (t >= stats_next) {
+    char buf[512];
+    if (write(stats_fd, buf, stats_json(buf, sizeof(buf))) < 0) {
+      stats_fd = -1;
+    }
+    stats_next = t + stats_period;
+  }
+}
+
+#ifdef MORTH_LIBRARY
+static void bye(Xt *self) { throw_err(MORTH_BYE); } // the host decides
+#else
+static void bye(Xt *self) { exit(0); }
+#endif
+
+// Each wordlist hashes names into buckets, and a bucket is a chain of words
+// through Word.link, newest first. Rolling the dictionary back lowers
+// top_word and moves every head pointing above it down its chain, so no
+// chain ever reaches a slot that a newer word may reuse.
+static cell buckets[WORDLIST_N][BUCKET_N];
+static cell wordlist_n = 1; // wordlist 0 holds the built-in words
+static cell current = 0;    // wordlist new definitions go into
+static cell order[ORDER_N] = {0};
+static cell order_n = 1;
+static cell boot_top = -1;  // words up to here can't be forgotten
+
+static cell *bucket(cell wid, const char *name) {
+  uint32_t h = 2166136261u; // FNV-1a
+  for (; *name; name++) {
+    h = (h ^ (unsigned char)*name) * 16777619u;
+  }
+  return &buckets[wid][h & (BUCKET_N - 1)];
+}
+
+// newest visible word called name in the search order, or -1
+static cell find_name(const char *name) {
+  for (int i = 0; i < order_n; i++) {
+    for (cell xt = *bucket(order[i], name); xt >= 0;
+         xt = dict[xt].link) {
+      if (xt != hidden && strcmp(dict[xt].name, name) == 0) {
+        return xt;
+      }
+    }
+  }
+  return -1;
+}
+
+// newest word named next_word, or -1
+static cell search(void) { return find_name(next_word); }
+
+// appends a word to the current wordlist, the caller fills in its body
+static Word *new_word(const char *name, func fn) {
+  if (top_word >= WORD_N - 1) {
+    throw_err(ERR_DICT_OVERFLOW);
+  }
+  if (strlen(name) >= NAMELEN) {
+    throw_err(ERR_NAME_LONG);
+  }
+  cell xt = top_word + 1;
+  top_word = xt;
+  xts[xt].fn = fn;
+  xts[xt].body = code_top;
+  Word *w = &dict[xt];
+  strcpy(w->name, name);
+  w->def_len = 0;
+  w->immediate = false;
+  w->operands = 0;
+  w->parses = false;
+  w->relinks = false;
+  w->wid = current;
+  w->here = memtop;
+  cell *head = bucket(current, name);
+  w->link = *head;
+  *head = xt;
+  dict_gen++;
+  return w;
+}
+
+// appends a cell to the body of the newest word
+static void emit(cell x) {
+  if (code_top >= CODE_N) {
+    throw_err(ERR_DICT_OVERFLOW);
+  }
+  code[code_top++] = x;
+  dict[top_word].def_len++;
+}
+
+// closes the body of the newest word
+static void emit_exit(void) {
+  emit(EXIT_XT);
+  dict[top_word].def_len--;
+}
+
+// start of the definition, or cached line, that code cell at belongs to
+static cell frame_base(cell at) {
+  if (at < boot_code) {
+    return at - at % LINE_CODE_N;
+  }
+  cell lo = 0, hi = top_word; // the newest word starting at or before at
+  while (lo < hi) {
+    cell mid = (lo + hi + 1) / 2;
+    if (xts[mid].body <= at) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return xts[lo].body;
+}
+
+// moves bucket heads back below top_word after it was lowered
+static void rewind_buckets(void) {
+  cell *heads = &buckets[0][0];
+  for (int i = 0; i < WORDLIST_N * BUCKET_N; i++) {
+    while (heads[i] > top_word) {
+      heads[i] = dict[heads[i]].link;
+    }
+  }
+}
+
+// drops every word from xt up
+static void forget_from(cell xt) {
+  if (xt <= boot_top || xt > top_word + 1) {
+    throw_err(ERR_FORGET);
+  }
+  if (xt <= top_word) {
+    memtop = dict[xt].here;
+    code_top = xts[xt].body;
+  }
+  top_word = xt - 1;
+  rewind_buckets();
+  dict_gen++;
+  memo_gen++; // a reused xt must not hit the old word's results
+}
+
+static void forget(Xt *self) {
+  if (*advance() == '\0') {
+    throw_err(ERR_NO_NAME);
+  }
+  cell xt = search();
+  if (xt < 0) {
+    throw_err(ERR_UNDEFINED);
+  }
+  forget_from(xt);
+}
+
+// a marker word keeps the wordlist state from before it was defined:
+// wordlist_n, current, order_n, then the order
+static void marker_restore(Xt *self) {
+  cell *saved = &code[self->body];
+  wordlist_n = saved[0];
+  current = saved[1];
+  order_n = saved[2];
+  memcpy(order, &saved[3], order_n * sizeof(cell));
+  forget_from(self - xts);
+}
+
+static void marker(Xt *self) {
+  if (*advance() == '\0') {
+    throw_err(ERR_NO_NAME);
+  }
+  new_word(next_word, marker_restore);
+  dict[top_word].relinks = true;
+  emit(wordlist_n);
+  emit(current);
+  emit(order_n);
+  for (int i = 0; i < order_n; i++) {
+    emit(order[i]);
+  }
+}
+
+static void wordlist(Xt *self) {
+  if (wordlist_n >= WORDLIST_N) {
+    throw_err(ERR_DICT_OVERFLOW);
+  }
+  for (int i = 0; i < BUCKET_N; i++) {
+    buckets[wordlist_n][i] = -1;
+  }
+  push_int(wordlist_n++);
+}
+
+static cell pop_wid(void) {
+  cell wid = pop_int();
+  if (wid < 0 || wid >= wordlist_n) {
+    throw_err(ERR_ARG);
+  }
+  return wid;
+}
+
+static void forth_wordlist(Xt *self) { push_int(0); }
+
+static void get_current(Xt *self) { push_int(current); }
+
+static void set_current(Xt *self) { current = pop_wid(); }
+
+// ( -- widn ... wid1 n ) wid1 is searched first
+static void get_order(Xt *self) {
+  for (int i = order_n - 1; i >= 0; i--) {
+    push_int(order[i]);
   }
-  return 1;
+  push_int(order_n);
 }
 
-cell read(Word *self, Word *caller) {
-  cell err = 1;
-  cell addr = pop_int(&err);
-  if (err != 1) {
-    return err;
+static void set_order(Xt *self) {
+  cell n = pop_int();
+  if (n > ORDER_N) {
+    throw_err(ERR_ORDER_OVERFLOW);
   }
-  if (addr >= MEMSIZE) {
-    return -6;
+  if (n < 0) { // -1 set-order: the built-in words only
+    n = 1;
+    order[0] = 0;
+  } else {
+    for (int i = 0; i < n; i++) {
+      order[i] = pop_wid();
+    }
   }
-  err = push_int(membank[addr]);
-  if (err != 1) {
-    return err;
-  };
-  return 1;
+  order_n = n;
+  dict_gen++;
 }
 
-cell negate(Word *self, Word *caller) {
-  cell err = 1;
-  cell cond = pop_int(&err);
-  if (err != 1) {
-    return err;
-  }
-  if (cond == 0) {
-    return push_int(1);
-  } else {
-    return push_int(0);
+static void definitions(Xt *self) {
+  if (order_n == 0) {
+    throw_err(ERR_ORDER_UNDERFLOW);
   }
-  return 1;
+  current = order[0];
 }
-cell bye(Word *self, Word *caller) { exit(0); }
 
-cell search(Word *, Word *);
-int allocate_literal(cell value);
+static void allocate_literal(cell value);
+static void allocate_fliteral(fcell value);
 
-cell create(Word *self, Word *caller) {
+static void create(Xt *self) {
   wordindef = 0;
   if (*advance() == '\0') {
-    return -1;
+    throw_err(ERR_NO_NAME);
   }
-  top_word++;
-  printf("created %s at position %i", next_word, top_word);
-  memcpy(dict[top_word].name, next_word, sizeof(next_word));
-  dict[top_word].enter = enter;
-  dict[top_word].def_len = 2;
-  dict[top_word].def[0] = 0; // litral
-  dict[top_word].def[1] = memtop;
-  dict[top_word].immediate = false;
-  return 1;
+  new_word(next_word, enter);
+  out_printf("created %s at position " CELL_FMT, next_word, top_word);
+  emit(0); // litral
+  emit(memtop);
+  emit_exit();
 }
 
-int compile(Word *self, Word *caller) {
-  int err = 1;
-  search(NULL, self);
-  int found = pop_int(&err);
-  if (err != 1)
-    return err;
+// distance of the local named name from the top of its frame, or -1
+static cell find_local(const char *name) {
+  for (cell i = local_n - 1; i >= 0; i--) {
+    if (strcmp(local_names[i], name) == 0) {
+      return local_n - 1 - i;
+    }
+  }
+  return -1;
+}
+
+static void compile(Xt *self) {
+  cell local = find_local(next_word);
+  if (local >= 0) {
+    emit(local_fetch_xt);
+    emit(local);
+    return;
+  }
+  cell found = search();
   if (found >= 0) {
     if (dict[found].immediate) {
-      cell err = dict[found].enter(&dict[found], NULL);
-      if (err != 1)
-        return err;
+      run(&xts[found]);
     } else {
-      dict[top_word].def[dict[top_word].def_len++] = found;
+      if (found == EXIT_XT && local_n > 0) {
+        emit(unlocals_xt);
+        emit(local_n);
+      }
+      last_call = code_top;
+      emit(found);
+      dict[top_word].parses |= dict[found].parses;
+      dict[top_word].relinks |= dict[found].relinks;
     }
   } else {
     cell to_push = 0;
+    fcell fto_push = 0;
     if (parse_num(next_word, 10, &to_push) == 1) {
       allocate_literal(to_push);
+    } else if (parse_float(next_word, &fto_push) == 1) {
+      allocate_fliteral(fto_push);
     } else {
-      printf("unknown word: %s\n", next_word);
+      throw_err(ERR_UNDEFINED);
     }
   }
-  return 1;
 }
 
-cell does(Word *self, Word *caller) {
+// ( "text<quote>" -- addr len ) one character per cell. Compiled, the text
+// is allotted along with the definition; interpreted, it is left at here
+// until the next allot or s" reuses the space.
+static void squote(Xt *self) {
+  if (inputidx < inputlen) {
+    inputidx++; // the space after s"
+  }
+  size_t start = inputidx;
+  while (inputidx < inputlen && inputbuff[inputidx] != '"') {
+    inputidx++;
+  }
+  cell n = inputidx - start;
+  if (inputidx < inputlen) {
+    inputidx++;
+  }
+  cell addr = memtop;
+  if (state) {
+    balloc_int(n);
+  } else if (n > heap.low - memtop) {
+    throw_err(ERR_DICT_OVERFLOW);
+  }
+  for (cell i = 0; i < n; i++) {
+    membank[addr + i] = (unsigned char)inputbuff[start + i];
+  }
+  if (state) {
+    allocate_literal(addr);
+    allocate_literal(n);
+  } else {
+    push_int(addr);
+    push_int(n);
+  }
+}
+
+static void does(Xt *self) {
   while (state != 0) {
     advance();
-    compile(NULL, self);
+    compile(NULL);
   }
-  return 1;
 }
 
-cell see(Word* self, Word* caller) {
+static void see(Xt *self) {
   advance();
-  search(NULL, self);
-  int err = 1;
-  cell word = pop_int(&err);
-  for (int i = 0; i<dict[word].def_len; i++) {
-    printf("%s ", dict[dict[word].def[i]].name);
-    if(dict[word].def[i] == 0) {
-      printf("%i ", dict[word].def[++i]);
+  cell word = search();
+  if (word < 0) {
+    throw_err(ERR_UNDEFINED);
+  }
+  if (xts[word].fn != enter && xts[word].fn != memo_enter) {
+    out_write("primitive\n", 10);
+    return;
+  }
+  cell *def = &code[xts[word].body];
+  for (int i = 0; i < dict[word].def_len; i++) {
+    cell xt = def[i];
+    if (xt < 0) {
+      out_printf("tail:%s ", dict[~xt].name);
+      continue;
+    }
+    out_printf("%s ", dict[xt].name);
+    if (xt == flit_xt) {
+      fcell f;
+      memcpy(&f, &def[++i], sizeof(fcell));
+      out_printf("%g ", (double)f);
+      continue;
+    }
+    for (int j = 0; j < dict[xt].operands; j++) {
+      out_printf(CELL_FMT " ", def[++i]);
     }
   }
-  putchar('\n');
-  return 1;
+  out_char('\n');
+}
+
+static void here(Xt *self) { push_int(memtop); }
+
+static void pushliteral(Xt *self) { push_int(code[++ip_d]); }
+
+static void pushfliteral(Xt *self) {
+  fcell n;
+  memcpy(&n, &code[++ip_d], sizeof(fcell));
+  push_float(n);
+}
+
+static void literal(Xt *self) {
+  cell n = pop_int();
+  emit(0);
+  emit(n);
+}
+
+static void tick(Xt *self) {
+  if (*advance() == '\0') {
+    throw_err(ERR_NO_NAME);
+  }
+  cell xt = search();
+  if (xt < 0) {
+    throw_err(ERR_UNDEFINED);
+  }
+  push_int(xt);
+}
+
+static void execute_xt(cell xt) {
+  if (xt < 0 || xt > top_word) {
+    throw_err(ERR_ARG);
+  }
+  run(&xts[xt]);
+}
+
+// execute is always reached through run, which steps on into whatever body
+// it enters, so it doesn't need a loop of its own
+static void execute(Xt *self) {
+  cell xt = pop_int();
+  if (xt < 0 || xt > top_word) {
+    throw_err(ERR_ARG);
+  }
+  xts[xt].fn(&xts[xt]);
+}
+
+// ( xt -- code ) code is 0 when xt returned normally
+static void catch(Xt *self) {
+  cell xt = pop_int();
+  push_int(guarded(execute_xt, xt));
 }
 
-cell here(Word *self, Word *caller) {
-  int err = push_int(memtop);
+static void throw(Xt *self) {
+  cell err = pop_int();
   if (err != 0) {
-    return err;
+    throw_err(err);
   }
-  return 1;
 }
 
-cell comma(Word *self, Word *caller) {
-  cell err = push_int(1);
-  if (err != 1) {
-    return -8;
+static void allocate_literal(cell value) {
+  emit(0);
+  emit(value);
+}
+
+static void allocate_fliteral(fcell value) {
+  cell bits;
+  memcpy(&bits, &value, sizeof(cell));
+  emit(flit_xt);
+  emit(bits);
+}
+
+// control flow words resolve against the definition being compiled. The data
+// stack holds the positions of unresolved operands and of backward targets,
+// and an operand is stored as the target's distance from the operand.
+static cell branch_xt, zbranch_xt, do_xt, loop_xt, plusloop_xt;
+
+static void emit_forward(cell xt) {
+  if (!state) {
+    throw_err(ERR_COMPILE_ONLY);
   }
-  cell place = balloc(NULL, self);
-  if (place >= 0) {
-    int num = pop_int(&err);
-    if (err != 1) {
-      return -8;
-    }
-    membank[place] = num;
+  emit(xt);
+  emit(0);
+  push_int(code_top - 1);
+}
+
+static void emit_backward(cell xt) {
+  cell dest = pop_int();
+  emit(xt);
+  emit(dest - code_top);
+}
+
+static void resolve(cell orig) {
+  if (orig < xts[top_word].body || orig >= code_top) {
+    throw_err(ERR_CONTROL);
   }
-  return 1;
+  code[orig] = code_top - orig;
+}
+
+static void cf_if(Xt *self) { emit_forward(zbranch_xt); }
+
+static void cf_then(Xt *self) { resolve(pop_int()); }
+
+static void cf_else(Xt *self) {
+  cell orig = pop_int();
+  emit_forward(branch_xt);
+  resolve(orig);
 }
 
-cell immediate(Word *self, Word *caller) {
-  if (top_word >= 0) {
-    dict[top_word].immediate = true;
+static void cf_begin(Xt *self) {
+  if (!state) {
+    throw_err(ERR_COMPILE_ONLY);
   }
-  return 1;
+  push_int(code_top);
 }
 
-int pushliteral(Word *word, Word *caller) {
-  cell err = 1;
-  cell ip = popr_int(&err);
-  err = pushr_int(ip + 1);
-  if (err != 1) {
-    return err;
+static void cf_until(Xt *self) { emit_backward(zbranch_xt); }
+
+static void cf_again(Xt *self) { emit_backward(branch_xt); }
+
+// begin ... while ... repeat: while's forward branch goes under begin's dest
+static void cf_while(Xt *self) {
+  cell dest = pop_int();
+  emit_forward(zbranch_xt);
+  push_int(dest);
+}
+
+static void cf_repeat(Xt *self) {
+  emit_backward(branch_xt);
+  resolve(pop_int());
+}
+
+static void cf_do(Xt *self) {
+  if (!state) {
+    throw_err(ERR_COMPILE_ONLY);
   }
-  cell n = caller->def[ip + 1];
-  return push_int(n);
+  emit(do_xt);
+  push_int(code_top);
 }
 
-int literal(Word *word, Word *caller) {
-  cell err = 1;
-  cell n = pop_int(&err);
-  dict[top_word].def[dict[top_word].def_len++] = 0;
-  dict[top_word].def[dict[top_word].def_len++] = n;
-  return 1;
+static void cf_loop(Xt *self) { emit_backward(loop_xt); }
+
+static void cf_plusloop(Xt *self) { emit_backward(plusloop_xt); }
+
+static void recurse(Xt *self) {
+  if (!state) {
+    throw_err(ERR_COMPILE_ONLY);
+  }
+  last_call = code_top;
+  emit(top_word);
 }
 
-int search(Word *self, Word *caller) {
-  for (int i = top_word; i >= 0; i--) {
-    if (strcmp(dict[i].name, next_word) == 0) {
-      push_int(i);
-      return 1;
-    }
+// { a b | c -- d } gives the definition a frame of locals on the return
+// stack: a and b are taken from the data stack, b from the top, c starts at
+// zero and whatever follows -- is a comment. A local's name compiles to
+// (local@) and to name to (local!), each carrying the local's distance from
+// the top of the frame, so reading one is a single dispatch wherever it is.
+// The frame is dropped before every exit, which keeps the definition's last
+// call from becoming a tail call. { throws -22 inside a control structure
+// or a second time in a definition.
+static void locals_enter(Xt *self) {
+  cell n = code[++ip_d];
+  cell k = code[++ip_d];
+#ifndef MORTH_GUARD
+  if (ds->sp < k - 1) {
+    throw_err(ERR_STACK_UNDERFLOW);
   }
-  push_int(-1);
-  return -1;
+  if (rs->sp + n > rs->max) {
+    throw_err(ERR_RSTACK_OVERFLOW);
+  }
+#endif
+  cell *frame = &rs->data[rs->sp + 1];
+  memcpy(frame, &ds->data[ds->sp - k + 1], k * sizeof(cell));
+  memset(frame + k, 0, (n - k) * sizeof(cell));
+  ds->sp -= k;
+  rs->sp += n;
 }
 
-int find_token_int() {
-  char *next = advance();
-  if (next[0] != '\0') {
-    search(NULL, NULL);
-    int err;
-    int wordidx = pop_int(&err);
-    if (wordidx >= 0) {
-      push_int(wordidx);
-      return 1;
+static void local_fetch(Xt *self) { push_int(rs->data[rs->sp - code[++ip_d]]); }
+
+static void local_store(Xt *self) {
+  cell at = rs->sp - code[++ip_d];
+  rs->data[at] = pop_int();
+}
+
+static void unlocals(Xt *self) { rs->sp -= code[++ip_d]; }
+
+static void cf_locals(Xt *self) {
+  if (!state) {
+    throw_err(ERR_COMPILE_ONLY);
+  }
+  if (local_n > 0 || ds->sp != def_sp) {
+    throw_err(ERR_CONTROL); // a second {, or one inside if, begin or do
+  }
+  cell taken = -1;
+  bool comment = false;
+  for (;;) {
+    if (*advance() == '\0') {
+      throw_err(ERR_CONTROL);
+    }
+    if (strcmp(next_word, "}") == 0) {
+      break;
+    } else if (comment) {
+      continue;
+    } else if (strcmp(next_word, "--") == 0) {
+      comment = true;
+    } else if (strcmp(next_word, "|") == 0 && taken < 0) {
+      taken = local_n;
+    } else if (local_n >= LOCAL_N) {
+      throw_err(ERR_ARG);
+    } else if (strlen(next_word) >= NAMELEN) {
+      throw_err(ERR_NAME_LONG);
     } else {
-      return -1;
+      strcpy(local_names[local_n++], next_word);
     }
-  } else {
-    return 2;
   }
-  return -1;
+  if (local_n > 0) {
+    emit(locals_xt);
+    emit(local_n);
+    emit(taken < 0 ? local_n : taken);
+  }
 }
 
-int tick(Word *word, Word *caller) { return find_token_int(); }
-
-int allocate_literal(cell value) {
-  dict[top_word].def[dict[top_word].def_len++] = 0;
-  dict[top_word].def[dict[top_word].def_len++] = value;
-  return 1;
+static void to_local(Xt *self) {
+  if (!state) {
+    throw_err(ERR_COMPILE_ONLY);
+  }
+  advance();
+  cell local = find_local(next_word);
+  if (local < 0) {
+    throw_err(ERR_UNDEFINED);
+  }
+  emit(local_store_xt);
+  emit(local);
 }
 
-int semicolon(Word *self, Word *caller) {
+static void semicolon(Xt *self) {
   /* for (int i; i < dict[top_word].def_len; i++) { */
   /*   printf("%s ", dict[dict[top_word].def[i]].name); */
   /* } */
+  if (ds->sp != def_sp) {
+    throw_err(ERR_CONTROL); // an if, begin or do left open
+  }
   state = 0;
+  hidden = -1;
+  dict_gen++;
+  if (local_n > 0) {
+    emit(unlocals_xt);
+    emit(local_n);
+    local_n = 0;
+  }
+  if (last_call >= 0 && last_call == code_top - 1 &&
+      xts[code[last_call]].fn == enter) {
+    code[last_call] = ~code[last_call];
+  }
+  last_call = -1;
+  emit_exit();
   //for (int i = 0; i < dict[top_word].def_len; i++) {
     //printf("%i ", dict[top_word].def[i]);
   //}
   //putchar('\n');
-  return 1;
 }
 
-int fadvance(Word *self, Word *caller) {
+static void fadvance(Xt *self) {
   advance();
-  return 1;
 }
 
-int colon(Word *word, Word *caller) {
+static void colon(Xt *self) {
   wordindef = 0;
   if (*advance() == '\0') {
-    printf("error: no definiton name\n");
-    return -1;
+    out_printf("error: no definiton name\n");
+    throw_err(ERR_NO_NAME);
   }
-  memcpy(dict[++top_word].name, next_word, sizeof(next_word));
-  dict[top_word].enter = enter;
+  def_code = code_top;
+  def_mem = memtop;
+  new_word(next_word, enter);
+  last_call = -1;
+  local_n = 0;
+  hidden = top_word;
+  def_sp = ds->sp;
   state = 1;
-  return 1;
 }
 
-void add_primitive(char *name, func function) {
-  top_word++;
-  memcpy(dict[top_word].name, name,
-         sizeof(char) * strlen(name) + sizeof(char) * 1);
-  dict[top_word].enter = function;
-  dict[top_word].def_len = 0;
-  dict[top_word].immediate = false;
+// one token of the outer interpreter
+static void interpret(cell unused) {
+  if (state != 0) {
+    compile(NULL);
+    return;
+  }
+  cell found = search();
+  if (found >= 0) {
+    run(&xts[found]);
+  } else {
+    cell to_push = 0;
+    fcell fto_push = 0;
+    if (parse_num(next_word, 10, &to_push) == 1) {
+      push_int(to_push);
+    } else if (parse_float(next_word, &fto_push) == 1) {
+      push_float(fto_push);
+    } else {
+      throw_err(ERR_UNDEFINED);
+    }
+  }
+}
+
+// drops a colon definition that failed to compile
+static void abandon_definition(void) {
+  if (hidden >= 0) {
+    dict_gen++;
+    top_word = hidden - 1;
+    rewind_buckets();
+    hidden = -1;
+    ds->sp = def_sp; // drops what if, begin and do left behind
+    code_top = def_code;
+    memtop = def_mem;
+  }
+  state = 0;
+  last_call = -1;
+  local_n = 0;
+}
+
+// Top-level lines made only of plain words and numbers are compiled into an
+// anonymous definition the first time they are seen, so running the same
+// line again skips lexing, lookup and number parsing. Every name is looked
+// up before any of it runs, so a word that changes lookup keeps the line
+// interpreted. A line is looked up
+// by its text and recompiled when the dictionary has changed since. Slot i
+// compiles to code at i * LINE_CODE_N, below every definition.
+typedef struct {
+  unsigned gen; // dict_gen the line was compiled against, 0 when empty
+  bool compiled; // false when the line has to go through interpret
+  int running; // nested runs, the slot is not reused while nonzero
+  size_t len;
+  char text[LINE_LEN];
+} CachedLine;
+
+static CachedLine line_cache[LINE_CACHE_N];
+
+// compiles the rest of the input to code at at, false if some token needs
+// the outer interpreter. Leaves the input where it was.
+static bool compile_line(cell *at) {
+  size_t start = inputidx;
+  bool ok = true;
+  cell *end = at + LINE_CODE_N - 1;
+  while (ok && *advance() != '\0') {
+    cell xt = search();
+    cell n;
+    fcell f;
+    if (end - at < 2) {
+      ok = false;
+    } else if (xt >= 0) {
+      ok = !dict[xt].immediate && !dict[xt].parses && !dict[xt].relinks &&
+           !dict[xt].operands;
+      *at++ = xt;
+    } else if (parse_num(next_word, 10, &n) == 1) {
+      *at++ = 0;
+      *at++ = n;
+    } else if (parse_float(next_word, &f) == 1) {
+      *at++ = flit_xt;
+      memcpy(at++, &f, sizeof(cell));
+    } else {
+      ok = false;
+    }
+  }
+  *at = EXIT_XT;
+  inputidx = start;
+  return ok;
 }
 
-void add_primitive_immediate(char *name, func function) {
-  top_word++;
-  memcpy(dict[top_word].name, name,
-         sizeof(char) * strlen(name) + sizeof(char) * 1);
-  dict[top_word].enter = function;
-  dict[top_word].def_len = 0;
-  dict[top_word].immediate = true;
+// slot holding the rest of the input compiled, or -1
+static cell cached_line(void) {
+  size_t len = inputlen - inputidx;
+  const char *text = inputbuff + inputidx;
+  if (len > LINE_LEN || memchr(text, '(', len)) {
+    return -1; // comments change pcount as they are read
+  }
+  uint64_t h = 14695981039346656037u; // FNV-1a
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)text[i]) * 1099511628211u;
+  }
+  cell slot = h & (LINE_CACHE_N - 1);
+  CachedLine *c = &line_cache[slot];
+  if (c->gen != dict_gen || c->len != len || memcmp(c->text, text, len)) {
+    if (c->running) {
+      return -1;
+    }
+    c->gen = dict_gen;
+    c->len = len;
+    memcpy(c->text, text, len);
+    c->compiled = compile_line(&code[slot * LINE_CODE_N]);
+  }
+  return c->compiled ? slot : -1;
 }
 
-void add_non_primitive(char name[], cell *def, cell def_len) {
-  top_word++;
-  memcpy(dict[top_word].name, name, strlen(name) + 1);
-  dict[top_word].enter = enter;
-  dict[top_word].def_len = def_len;
-  memcpy(&dict[top_word].def, def, def_len * sizeof(cell));
-  dict[top_word].immediate = false;
+static void run_line(cell slot) {
+  Xt line = {.fn = enter, .body = slot * LINE_CODE_N};
+  run(&line);
 }
 
-int main() {
-  dict = (Word *)malloc(WORD_N * sizeof(Word));
-  membank = (cell *)malloc(MEMSIZE * sizeof(cell));
+// runs the outer interpreter over the rest of the input, returns 0 or the
+// first code thrown
+static cell interpret_input(void) {
+  cell err = 0;
+  cell slot = state == 0 ? cached_line() : -1;
+  if (slot >= 0) {
+    inputidx = inputlen; // a word that parses anyway sees no input
+    line_cache[slot].running++;
+    err = guarded(run_line, slot);
+    if (susp.active) {
+      susp.slot = slot; // still running, as far as the cache is concerned
+    } else {
+      line_cache[slot].running--;
+    }
+  }
+  while (slot < 0 && *advance() != '\0') {
+    err = guarded(interpret, 0);
+    if (susp.active) {
+      susp.len = inputlen - inputidx;
+      susp.input = malloc(susp.len + 1);
+      memcpy(susp.input, inputbuff + inputidx, susp.len);
+      break;
+    }
+    if (err != 0) {
+      abandon_definition();
+      break;
+    }
+  }
+  stats_due();
+  return err;
+}
+
+// lets go of a suspended run
+static void drop_suspended(void) {
+  if (susp.slot >= 0) {
+    line_cache[susp.slot].running--;
+  }
+  free(susp.input);
+  susp = (Suspended){.slot = -1};
+}
+
+// the stacks as they were when the run stopped, in a new catch frame that
+// saved them as they were when it started
+static void resume_run(cell unused) {
+  ds->sp = susp.ds_sp;
+  rs->sp = susp.rs_sp;
+  ls->sp = susp.ls_sp;
+  fs->sp = susp.fs_sp;
+  ip_d = susp.ip;
+  susp.active = false;
+  step(handler->rs_sp);
+}
+
+static void add_primitive(const char *name, func function) {
+  new_word(name, function);
+}
+
+static void add_primitive_immediate(const char *name, func function) {
+  new_word(name, function)->immediate = true;
+}
+
+static char *reserved_lo, *reserved_hi; // around membank, all of it faults
+
+// membank is reserved with room for mapped files above it, page aligned so
+// pmap chunks never share a cache line
+static cell *membank_mem(void) {
+  size_t len = (MEMSIZE * sizeof(cell) + page - 1) / page * page;
+#ifdef MEM_GUARD
+  size_t span = ((size_t)1 << 32) * sizeof(cell); // every 32-bit address
+#else
+  size_t span = len + MAP_CELLS * sizeof(cell) + page;
+#endif
+  char *m = mmap(NULL, span, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (m == MAP_FAILED) {
+    perror("morth: membank");
+    exit(1);
+  }
+  reserved_lo = m;
+  reserved_hi = m + span;
+#ifdef MEM_GUARD
+  m += span / 2; // address 0, negative ones sit below
+#endif
+  if (mprotect(m, len, PROT_READ | PROT_WRITE)) {
+    perror("morth: membank");
+    exit(1);
+  }
+  return (cell *)m;
+}
+
+#ifdef MORTH_GUARD
+static void on_fault(int sig, siginfo_t *si, void *context) {
+  char *a = si->si_addr;
+  cell code = 0;
+  if (handler) {
+    code = stack_fault(ds->data, a, ERR_STACK_OVERFLOW, ERR_STACK_UNDERFLOW);
+    if (!code) {
+      code = stack_fault(rs->data, a, ERR_RSTACK_OVERFLOW,
+                         ERR_RSTACK_UNDERFLOW);
+    }
+    if (!code) {
+      code = stack_fault(fs->data, a, ERR_FSTACK_OVERFLOW,
+                         ERR_FSTACK_UNDERFLOW);
+    }
+    if (!code && a >= reserved_lo && a < reserved_hi) {
+      code = ERR_ADDRESS;
+    }
+  }
+  if (!code) { // a real crash, let it happen
+    signal(SIGSEGV, SIG_DFL);
+    return;
+  }
+  throw_err(code);
+}
+#endif
 
-  int idx = 0;
+static void boot(void) {
+  xts = (Xt *)malloc(WORD_N * sizeof(Xt));
+  dict = (Word *)malloc(WORD_N * sizeof(Word));
+  code = (cell *)malloc(CODE_N * sizeof(cell));
+  code_top = boot_code = LINE_CACHE_N * LINE_CODE_N;
+  page = sysconf(_SC_PAGESIZE);
+#ifdef MORTH_GUARD
+  // SA_NODEFER since on_fault leaves by longjmp rather than returning
+  struct sigaction sa = {.sa_sigaction = on_fault,
+                         .sa_flags = SA_SIGINFO | SA_NODEFER};
+  sigaction(SIGSEGV, &sa, NULL);
+#endif
+  membank = membank_mem();
+  stack_init(&main_ds);
+  stack_init(&main_rs);
+  stack_init(&main_ls);
+  fstack_init(&main_fs);
+  tasks = calloc(TASK_N, sizeof(Task)); // untouched pages stay unbacked
+  base_addr = balloc_int(1);
+  membank[base_addr] = 10;
+  out_tty = isatty(STDOUT_FILENO);
+  atexit(out_flush);
+  memset(buckets, -1, sizeof(buckets));
+  memset(heap.small, -1, sizeof(heap.small));
 
   add_primitive("lit", pushliteral); // must be first!!!!
+  dict[top_word].operands = 1;
+  add_primitive("exit", exit_word); // and this second, see run
+  add_primitive("flit", pushfliteral);
+  dict[top_word].operands = 1;
+  flit_xt = top_word;
   add_primitive("+", add);
   add_primitive("*", mul);
   add_primitive("/", divide);
   add_primitive("-", sub);
-  add_primitive("%", sub);
+  add_primitive("%", mod);
   add_primitive("2+", add2);
   add_primitive("2*", mul2);
   add_primitive("2/", divide2);
   add_primitive("2-", sub2);
   add_primitive("2%", mod2);
   add_primitive(".", dot);
+  add_primitive("u.", udot);
+  add_primitive("emit", emit_char);
+  add_primitive("cr", cr);
+  add_primitive("type", type);
+  add_primitive("base", base);
+  add_primitive("hex", hex);
+  add_primitive("decimal", decimal);
   add_primitive("<", lth);
   add_primitive(">", gth);
   add_primitive("2<", lth2);
   add_primitive("2>", gth2);
-  add_primitive("dup", dup);
+  add_primitive("dup", dupe);
   add_primitive("pop", pop);
   add_primitive("swp", swp);
   add_primitive("ovr", ovr);
   add_primitive("rot", rot);
   add_primitive(":", colon);
+  dict[top_word].parses = true;
   add_primitive("jmp", jmp);
   add_primitive("jmpz", jmpz);
-  add_primitive("free", bfree);
+  add_primitive("branch", branch);
+  dict[top_word].operands = 1;
+  branch_xt = top_word;
+  add_primitive("0branch", zbranch);
+  dict[top_word].operands = 1;
+  zbranch_xt = top_word;
+  add_primitive("(do)", pushloop);
+  do_xt = top_word;
+  add_primitive("(loop)", doloop);
+  dict[top_word].operands = 1;
+  loop_xt = top_word;
+  add_primitive("(+loop)", doplusloop);
+  dict[top_word].operands = 1;
+  plusloop_xt = top_word;
+  add_primitive("i", loop_i);
+  add_primitive("j", loop_j);
+  add_primitive("unloop", unloop);
+  add_primitive("allocate", allocate);
+  add_primitive("free", heap_free_word);
+  add_primitive("resize", resize);
+  add_primitive("heap-stats", heap_stats);
+  add_primitive("stats", stats);
   add_primitive("not", negate);
   add_primitive("or", or);
   add_primitive("and", and);
   add_primitive("bye", bye);
   add_primitive("create", create);
+  dict[top_word].parses = true;
   add_primitive("literal", literal);
   add_primitive("allot", balloc);
   add_primitive("here", here);
-  add_primitive("@", read);
-  add_primitive("!", write);
+  add_primitive("@", fetch);
+  add_primitive("!", store);
   add_primitive("see", see);
+  dict[top_word].parses = true;
+  add_primitive("stream", stream_open);
+  dict[top_word].parses = true;
+  add_primitive("stream-end", stream_end);
+  add_primitive("stream-rate", stream_rate);
+  add_primitive("out", out);
+  add_primitive("xruns", xruns);
+  add_primitive("underruns", underruns);
+  add_primitive("blk-lat", blk_lat);
+  add_primitive("blk-lat-max", blk_lat_max);
+  add_primitive("lat-p50", lat_p50);
+  add_primitive("lat-p99", lat_p99);
+  add_primitive("lat-max", lat_max);
+  add_primitive("lat-reset", lat_reset);
+  add_primitive("f+", fadd);
+  add_primitive("f-", fsub);
+  add_primitive("f*", fmul);
+  add_primitive("f/", fdiv);
+  add_primitive("fsin", fsine);
+  add_primitive("fexp", fexpo);
+  add_primitive("fsqrt", fsqroot);
+  add_primitive("fnegate", fnegate);
+  add_primitive("fdup", fdup);
+  add_primitive("fdrop", fdrop);
+  add_primitive("fswap", fswap);
+  add_primitive("fover", fover);
+  add_primitive("f.", fdot);
+  add_primitive("f<", flth);
+  add_primitive("s>f", int_to_float);
+  add_primitive("f>s", float_to_int);
+  add_primitive("f@", float_read);
+  add_primitive("f!", float_write);
+  add_primitive("fv+", fvadd);
+  add_primitive("fv*", fvmul);
+  add_primitive("fvscale", fvscale);
+  add_primitive("fvsum", fvsum);
+  add_primitive("q15+", q15add);
+  add_primitive("q15-", q15sub);
+  add_primitive("q15*", q15mul);
+  add_primitive("q31+", q31add);
+  add_primitive("q31-", q31sub);
+  add_primitive("q31*", q31mul);
+  add_primitive("f>q15", float_to_q15);
+  add_primitive("q15>f", q15_to_float);
+  add_primitive("'", tick);
+  dict[top_word].parses = true;
+  add_primitive("execute", execute);
+  add_primitive("catch", catch);
+  add_primitive("throw", throw);
+  add_primitive("voice", voice_add);
+  add_primitive("voice-del", voice_del);
+  add_primitive("voice#", voice_id);
+  add_primitive("voice-cpu", voice_cpu);
+  add_primitive("render", render);
+  add_primitive("mix@", mix_read);
+  add_primitive("pmap", pmap);
+  add_primitive("preduce", preduce);
+  add_primitive("sort", sort);
+  add_primitive("sort-by", sort_by);
+  add_primitive("bsearch", bsearch_cells);
+  add_primitive("unique", unique);
+  add_primitive("hash-range", hash_range);
+  add_primitive("htable", htable);
+  add_primitive("hfree", hfree);
+  add_primitive("h@", hfetch);
+  add_primitive("h!", hstore);
+  add_primitive("hdel", hdel);
+  add_primitive("hcount", hcount);
+  add_primitive("hiter", hiter);
+  add_primitive("pure", pure);
+  add_primitive("memo-clear", memo_clear);
+  add_primitive("memo-stats", memo_stats);
+  add_primitive("task", task);
+  add_primitive("yield", yield);
+  add_primitive("pause", pause_task);
+  add_primitive("wake", wake);
+  add_primitive("task#", task_id);
+  add_primitive("map-file", map_file);
+  add_primitive("unmap", unmap);
+  add_primitive("r/o", map_ro);
+  add_primitive("cow", map_cow);
+  add_primitive("wav16", map_wav16);
+  add_primitive("w@", wfetch);
+  add_primitive("w!", wstore);
   add_primitive_immediate("compile", compile);
   add_primitive_immediate(";", semicolon);
   add_primitive_immediate("advance", fadvance);
   add_primitive_immediate("does>", does);
+  add_primitive_immediate("s\"", squote);
+  add_primitive_immediate("if", cf_if);
+  add_primitive_immediate("else", cf_else);
+  add_primitive_immediate("then", cf_then);
+  add_primitive_immediate("begin", cf_begin);
+  add_primitive_immediate("until", cf_until);
+  add_primitive_immediate("again", cf_again);
+  add_primitive_immediate("while", cf_while);
+  add_primitive_immediate("repeat", cf_repeat);
+  add_primitive_immediate("do", cf_do);
+  add_primitive_immediate("loop", cf_loop);
+  add_primitive_immediate("+loop", cf_plusloop);
+  add_primitive_immediate("recurse", recurse);
+  add_primitive_immediate("{", cf_locals);
+  add_primitive_immediate("to", to_local);
+  add_primitive("(locals)", locals_enter);
+  dict[top_word].operands = 2;
+  locals_xt = top_word;
+  add_primitive("(local@)", local_fetch);
+  dict[top_word].operands = 1;
+  local_fetch_xt = top_word;
+  add_primitive("(local!)", local_store);
+  dict[top_word].operands = 1;
+  local_store_xt = top_word;
+  add_primitive("(unlocals)", unlocals);
+  dict[top_word].operands = 1;
+  unlocals_xt = top_word;
+  add_primitive("marker", marker);
+  dict[top_word].parses = true;
+  add_primitive("forget", forget);
+  dict[top_word].parses = true;
+  dict[top_word].relinks = true;
+  add_primitive("wordlist", wordlist);
+  add_primitive("forth-wordlist", forth_wordlist);
+  add_primitive("get-current", get_current);
+  add_primitive("set-current", set_current);
+  add_primitive("get-order", get_order);
+  add_primitive("set-order", set_order);
+  dict[top_word].relinks = true;
+  add_primitive("definitions", definitions);
+  boot_top = top_word;
+
+}
+
+struct Morth {
+  morth_prim host[HOST_N];
+  int host_n;
+};
+
+static Morth the_vm;
+static bool booted = false;
+
+Morth *morth_new(void) {
+  if (booted) {
+    return NULL;
+  }
+  booted = true;
+  boot();
+  return &the_vm;
+}
+
+int morth_eval(Morth *vm, const char *buf, size_t len) {
+  if (!handler) {
+    drop_suspended();
+  }
+  // saved so a host primitive can evaluate source of its own
+  const char *outer_buff = inputbuff;
+  size_t outer_len = inputlen, outer_idx = inputidx;
+  inputbuff = buf;
+  inputlen = len;
+  inputidx = 0;
+  cell err = interpret_input();
+  out_flush();
+  inputbuff = outer_buff;
+  inputlen = outer_len;
+  inputidx = outer_idx;
+  return err;
+}
+
+int morth_push(Morth *vm, int64_t x) {
+  if (ds->sp >= ds->max) {
+    return ERR_STACK_OVERFLOW;
+  }
+  ds->data[++ds->sp] = x;
+  return 0;
+}
+
+int morth_pop(Morth *vm, int64_t *x) {
+  if (ds->sp < 0) {
+    return ERR_STACK_UNDERFLOW;
+  }
+  *x = ds->data[ds->sp--];
+  return 0;
+}
+
+int morth_find(Morth *vm, const char *name) { return find_name(name); }
+
+int morth_call(Morth *vm, int xt) {
+  if (!handler) {
+    drop_suspended();
+  }
+  return guarded(execute_xt, xt);
+}
+
+int morth_resume(Morth *vm) {
+  if (!susp.active || handler) {
+    return ERR_ARG;
+  }
+  Suspended was = susp;
+  cell err = guarded(resume_run, 0);
+  if (susp.active) { // stopped again
+    susp.slot = was.slot;
+    susp.input = was.input;
+    susp.len = was.len;
+    out_flush();
+    return err;
+  }
+  susp = (Suspended){.slot = -1};
+  if (was.slot >= 0) {
+    line_cache[was.slot].running--;
+  }
+  if (err) {
+    abandon_definition();
+  } else if (was.len > 0) {
+    err = morth_eval(vm, was.input, was.len); // the rest of the line
+  }
+  free(was.input);
+  out_flush();
+  return err;
+}
+
+void morth_set_fuel(Morth *vm, int64_t n) {
+  atomic_store(&fuel, n < 0 ? INT64_MAX : n);
+  fuel_tick = 0;
+}
+
+int64_t morth_fuel(Morth *vm) {
+  int64_t left = atomic_load(&fuel);
+  if (left > INT64_MAX / 2) {
+    return -1;
+  }
+  return left + (fuel_tick > 0 ? fuel_tick : 0);
+}
+
+void morth_set_deadline(Morth *vm, int64_t ns) {
+  atomic_store(&deadline, ns > 0 ? now_ns() + ns : 0);
+  if (fuel_tick > 0) { // hand the slice back so the deadline is seen soon
+    atomic_fetch_add(&fuel, fuel_tick);
+  }
+  fuel_tick = 0;
+}
+
+void morth_stats(Morth *vm, MorthStats *st) { stats_read(st); }
+
+void morth_stats_every(Morth *vm, int fd, int64_t ms) {
+  stats_fd = fd;
+  stats_period = ms > 0 ? ms * 1000000 : 0;
+  stats_next = 0;
+  if (fuel_tick > 0) { // as with a deadline, the next check looks
+    atomic_fetch_add(&fuel, fuel_tick);
+  }
+  fuel_tick = 0;
+}
+
+void morth_reset(Morth *vm) {
+  drop_suspended();
+  abandon_definition();
+  ds->sp = -1;
+  rs->sp = -1;
+  ls->sp = -1;
+  fs->sp = -1;
+  pcount = 0;
+}
 
-  FILE* test_file = fopen("test.4th", "r");
-  if (!test_file) {
+static void host_call(Xt *self) {
+  the_vm.host[code[self->body]](&the_vm);
+}
+
+int morth_add_primitive(Morth *vm, const char *name, morth_prim fn) {
+  if (strlen(name) >= NAMELEN) {
+    return ERR_NAME_LONG;
+  }
+  if (vm->host_n >= HOST_N || top_word >= WORD_N - 1 ||
+      code_top >= CODE_N) {
+    return ERR_DICT_OVERFLOW;
+  }
+  vm->host[vm->host_n] = fn;
+  add_primitive(name, host_call);
+  emit(vm->host_n++);
+  return 0;
+}
+
+_Noreturn void morth_throw(Morth *vm, int code) { throw_err(code); }
+
+#ifndef MORTH_LIBRARY
+static void report(cell err) {
+  if (err == ERR_UNDEFINED) {
+    out_printf("unknown word: %s\n", next_word);
+  } else {
+    out_printf("ERROR: " CELL_FMT "\n", err);
+  }
+}
+
+// reports errors and carries on with the rest of the file
+static int load(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "morth: cannot read %s\n", path);
     return -1;
   }
-  FILE *f = fopen("test.4th", "r");
   fseek(f, 0, SEEK_END);
   long fsize = ftell(f);
-  inputbuff = (char *)malloc(fsize);
+  char *src = (char *)malloc(fsize);
   fseek(f, 0, SEEK_SET);  /* same as rewind(f); */
-  fread(inputbuff, fsize, 1, f);
+  fsize = fread(src, 1, fsize, f);
   fclose(f);
 
-  inputbuff[fsize] = 0;
-  /*while (1) {
+  // a line at a time like the REPL, so an error only drops its own line
+  for (long at = 0; at < fsize;) {
+    const char *nl = memchr(src + at, '\n', fsize - at);
+    long end = nl ? nl - src + 1 : fsize;
+    inputbuff = src + at;
+    inputlen = end - at;
     inputidx = 0;
-  */
-    while (strcmp(advance(), "") != 0) {
-      if (state == 0) { // interpret mode
-        int err = search(NULL, NULL);
-        int found = pop_int(&err);
-        if (found >= 0) {
-          cell err = dict[found].enter(&dict[found], NULL);
-          if (err != 1)
-            printf("ERROR: %i\n", err);
-        } else {
-          cell to_push = 0;
-          if (parse_num(next_word, 10, &to_push) == 1) {
-            push_int(to_push);
-          } else {
-            printf("unknown word: %s", next_word);
-          }
-        }
-      } else { // compile mode
-        compile(NULL, NULL);
-      }
+    cell err = interpret_input();
+    if (err != 0) {
+      report(err);
+    }
+    at = end;
+  }
+  free(src);
+  return 0;
+}
+
+// one line at a time from stdin, an error drops the rest of its line
+static void repl(void) {
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  for (;;) {
+    out_flush(); // the other end of a pipe waits for the reply
+    if ((len = getline(&line, &cap, stdin)) < 0) {
+      break;
+    }
+    inputbuff = line;
+    inputlen = len;
+    inputidx = 0;
+    cell err = interpret_input();
+    if (err != 0) {
+      report(err);
+    } else {
+      out_printf(state ? " compiled\n" : " ok\n");
+    }
+  }
+  free(line);
+}
+
+// morth [file | -]... loads the files in order, - or no arguments reads stdin
+int main(int argc, char **argv) {
+  morth_new();
+  if (getenv("MORTH_LATENCY")) {
+    atexit(latency_dump);
+  }
+  const char *stats_env = getenv("MORTH_STATS"); // fd[:ms]
+  if (stats_env) {
+    char *ms;
+    int fd = strtol(stats_env, &ms, 10);
+    morth_stats_every(&the_vm, fd, *ms == ':' ? atoll(ms + 1) : 1000);
+  }
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-") == 0) {
+      repl();
+    } else if (load(argv[i]) != 0) {
+      return 1;
     }
-  /*}*/
+  }
+  if (argc == 1) {
+    repl();
+  }
   free(dict);
-  free(membank);
-  free(inputbuff);
   return 0;
 }
+#endif
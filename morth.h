@@ -0,0 +1,65 @@
+#ifndef MORTH_H
+#define MORTH_H
+
+// morth as a library: build morth.c with -DMORTH_LIBRARY and link it in.
+// Only the morth_ names below are exported.
+// There is one VM per process, words defined by one morth_eval stay visible
+// to the next. Calls return 0 or a negative ANS throw code.
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Morth Morth;
+typedef void (*morth_prim)(Morth *vm);
+
+// boots the VM, NULL if it was already booted
+Morth *morth_new(void);
+// interprets len bytes of source, stops at the first error
+int morth_eval(Morth *vm, const char *buf, size_t len);
+int morth_push(Morth *vm, int64_t x);
+int morth_pop(Morth *vm, int64_t *x);
+// xt of the newest word called name, or -1
+int morth_find(Morth *vm, const char *name);
+int morth_call(Morth *vm, int xt);
+// empties the stacks and leaves compile mode, the dictionary is kept
+void morth_reset(Morth *vm);
+// fn runs with the VM's stacks and reaches them through morth_push/morth_pop
+int morth_add_primitive(Morth *vm, const char *name, morth_prim fn);
+// for use inside a primitive, unwinds to the enclosing eval or catch
+_Noreturn void morth_throw(Morth *vm, int code);
+
+// Budgets for untrusted code. Fuel is counted in backward branches and
+// calls, n < 0 for no limit; the deadline is ns from now, 0 for none, and
+// is looked at every FUEL_SLICE checks. Both stay until set again. When one
+// runs out, morth_eval or morth_call returns MORTH_FUEL or MORTH_DEADLINE
+// and, unless it stopped under catch or inside a primitive, leaves the run
+// suspended for morth_resume. Until then the stacks belong to it; any other
+// eval, call or reset drops it.
+#define MORTH_FUEL -256
+#define MORTH_DEADLINE -257
+#define MORTH_BYE -258 // bye, which only exits the process in the CLI
+void morth_set_fuel(Morth *vm, int64_t n);
+// fuel left, -1 for no limit
+int64_t morth_fuel(Morth *vm);
+void morth_set_deadline(Morth *vm, int64_t ns);
+// carries on a suspended run and the rest of its source, -24 if none
+int morth_resume(Morth *vm);
+
+// What a script has used so far, next to the limits morth was built with.
+// Dispatches and calls count every thread, the stack depths are the
+// interpreter's deepest, in cells.
+typedef struct MorthStats {
+  uint64_t dispatches, calls;
+  int64_t ds_high, rs_high, stack_limit;
+  int64_t words, word_limit; // dictionary entries
+  int64_t code, code_limit;  // cells of compiled code
+  int64_t memtop, mem_limit; // membank cells below here, and all of it
+  int64_t heap_used;         // cells in live heap blocks
+  uint64_t allocs, frees;
+} MorthStats;
+void morth_stats(Morth *vm, MorthStats *st);
+// writes the stats as a line of JSON to fd every ms while code runs, and
+// after an eval when one is due; fd < 0 stops
+void morth_stats_every(Morth *vm, int fd, int64_t ms);
+
+#endif